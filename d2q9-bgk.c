@@ -49,6 +49,7 @@
 ** if you choose a different obstacle file.
 */
 
+#define _GNU_SOURCE  /* posix_memalign, MAP_ANONYMOUS, MAP_HUGETLB and MADV_HUGEPAGE under -std=c99 */
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
@@ -57,15 +58,52 @@
 #include <mpi.h>
 #include <sys/resource.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/mman.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#else
+#define HAVE_X86_SIMD 0
+#endif
 
 #define NSPEEDS         9
 #define FINALSTATEFILE  "final_state.dat"
 #define AVVELSFILE      "av_vels.dat"
+#define FINALSTATEBINFILE  "final_state.bin"
+#define AVVELSBINFILE      "av_vels.bin"
+#define CHECKPOINTFILE     "checkpoint_%d.bin"
 const int TEST = 1;
-const int ASYNC_HALOS = 0;
+const int ASYNC_HALOS = 0;  // overlap the halo exchange with the interior cells, see timestep_overlapped()
 const int SPREAD_COLS_EVENLY = 1;
 const int MERGE_TIMESTEP = 1;
 const int REDUCE_HALO_SPEED_ECHANGE = 1;
+const int HALO_CHECK = 0;   // every this many steps compare the pulled halos against an exchange of all speeds, 0 for never
+const int SIMD_KERNEL = 1;  // pick an AVX2/AVX-512 merged kernel from CPUID at startup
+const int AA_PATTERN = 0;   // stream in place on a single lattice, see aa_even_step()
+const int PUSH_STREAMING = 0;  // collide each cell from its own values and push the result out, see push_row_ops()
+const int CART_2D = 1;      // 2D block decomposition from MPI_Dims_create, 0 for column strips
+const int LOAD_BALANCE = 1; // split cols/rows by fluid-cell weighted cost instead of evenly
+const float OBSTACLE_COST_STEP = 0.125f;  // obstacle cell costs are rounded to this, see default_obstacle_cost()
+const int REPORT_IMBALANCE = 1;  // print predicted vs measured compute load per rank
+const int MPIIO_OUTPUT = 1;  // every rank writes its own block of final_state with MPI-IO
+const int BINARY_OUTPUT = 0; // with MPIIO_OUTPUT, write raw records instead of fixed-width text
+const int CHECKPOINT_EVERY = 1000;  // iterations between checkpoints, 0 for none
+const int HALO_DEPTH = 1;   // halo width k, halos are exchanged once every k steps
+const int TEMPORAL_BLOCKING = 0;  // advance the HALO_DEPTH steps tile by tile, see timestep_blocked()
+const int TILE_ROWS = 16;   // rows per tile of the temporally blocked sweep
+const int SPARSE_LATTICE = 0;  // store only the cells the fluid needs, see sparse_create()
+const int SPEED_PADDING = 16;  // floats between the speed arrays of a lattice, a multiple of 16 keeps them aligned
+const int HUGE_PAGES = 1;      // back lattices with 0 normal, 1 transparent or 2 explicit huge pages
+const int HALF_STORAGE = 0;    // 16 bit lattices, fp32 collisions: 0 off, 1 bf16 (refused), 2 fp16, 3 fp16 deviations, see half_check()
+const float HALF_ROUNDOFF = 0x1.0p-11f;  // fp16 unit roundoff, --half-check=DIR accepts HALF_ROUNDOFF*sqrt(maxIters) against fp32
+const int ROW_PADDING = -1;    // floats after each row, -1 picks them from nx, see row_pitch(); --row-padding=N overrides
+const int VELS_BATCH = 64;     // steps of velocity sums per nonblocking reduction to rank 0, see vels_flush()
+const int SHARED_HALOS = 0;    // read the halos of same-node neighbours from MPI-3 shared windows, see exchange_halos_shared()
 
 /* struct to hold the parameter values */
 typedef struct
@@ -77,8 +115,33 @@ typedef struct
   float density;       /* density per link */
   float accel;         /* density redistribution */
   float omega;         /* relaxation parameter */
+  int    accel_row;     /* first row accelerate_flow works on, -1 if a child doesn't hold it */
+  int    accel_stride;  /* rows between copies of it, a strip with deep halos holds two */
+  int    halo_cols;     /* width of the halo cols either side */
+  int    halo_rows;     /* width of the halo rows either side */
+  int    pitch;         /* cells between the starts of two rows, nx plus padding */
 } t_param;
 
+/* struct to hold this process' place in the process grid */
+typedef struct
+{
+  MPI_Comm comm;        /* periodic cartesian communicator, same ranks as MPI_COMM_WORLD */
+  int    dims[2];       /* no. of processes in x- and y-direction */
+  int    coords[2];     /* position of this process in the grid */
+  int    left, right;   /* neighbours in x-direction */
+  int    down, up;      /* neighbours in y-direction */
+  int    corners[4];    /* diagonal neighbours: down-left, down-right, up-left, up-right */
+  int    start_col, ncols;  /* global cols owned by this process */
+  int    start_row, nrows;  /* global rows owned by this process */
+  int*   col_splits;    /* first global col of each column of processes, dims[0]+1 entries */
+  int*   row_splits;    /* first global row of each row of processes, dims[1]+1 entries */
+  float  obstacle_cost; /* measured cost of an obstacle cell, relative to a fluid cell */
+  MPI_Comm node;        /* processes sharing memory with this one, with SHARED_HALOS */
+  int    node_peers[4]; /* rank in node of the left, right, down and up neighbours, -1 on another node */
+  int    peer_nx[4], peer_ny[4], peer_pitch[4];  /* the shapes of their child lattices, see neighbour_shapes() */
+  int    rma_halos;     /* exchange_halos() by MPI_Put: 0 off, 1 under fences, 2 under PSCW, see --halos= */
+} t_decomp;
+
 /* struct to hold the 'speed' values */
 typedef struct
 {
@@ -88,69 +151,273 @@ typedef struct
 typedef struct
 {
   float* restrict speeds[NSPEEDS];
+  unsigned short* restrict half[NSPEEDS];  /* the speeds as 16 bit floats instead, see create_half_speed_arrays() */
+  void*  arena;         /* one allocation holding all speeds, see alloc_speed_arena() */
+  size_t arena_len;     /* its length in bytes */
+  int    arena_mapped;  /* from mmap instead of posix_memalign */
+  MPI_Win win;          /* shared window holding the arena, if arena_shared */
+  int    arena_shared;
+  char*  peer_arenas[4];  /* the aligned arenas of the same-node neighbours, same order as node_peers */
 } t_speed_arrays;
 
+/* an in-flight checkpoint of one process, see checkpoint_start() */
+typedef struct
+{
+  char   path[256];     /* this process' checkpoint file */
+  char   tmp_path[256]; /* written here first, renamed to path once complete */
+  char*  buffer;        /* snapshot being written */
+  size_t len;           /* size of the snapshot in bytes */
+  MPI_File fh;
+  MPI_Request requests[NSPEEDS + 2];  /* header, one per speed, velocities */
+  int    nrequests;
+  int    pending;       /* 1 while a write is in flight */
+} t_checkpoint;
+
+/* per-step velocity sums on their way to rank 0 in batches, see vels_flush() */
+typedef struct
+{
+  float* sums[2];       /* this process' sums for the batch being filled and the one in flight */
+  int    current;       /* sums[current] is being filled */
+  int    start;         /* the step of its first entry */
+  MPI_Request request;  /* reduction of the other one */
+  int    flight_start, flight_end;  /* its steps */
+  float* av_vels;       /* rank 0 only: where the batches land, averaged once they have */
+  int    landed;        /* rank 0: steps of av_vels that are final */
+  int    tot_u;         /* rank 0: fluid cells of the whole grid */
+} t_vels;
+
+/* a halo to send and where the matching halo from the opposite neighbour lands */
+typedef struct
+{
+  MPI_Datatype send, recv;
+} t_halo_pair;
+
+/* halo exchange datatypes pointing into one lattice, see halo_types() */
+typedef struct
+{
+  t_speed_arrays* cells;    /* the lattice */
+  t_halo_pair pull[4];      /* exchange_halos(), to the left, right, down and up */
+  t_halo_pair aa_push[4];   /* exchange_halos_aa_reverse(), same order */
+  t_halo_pair edges[4];     /* pull into the halos next to the owned cells only, same order as pull */
+  t_halo_pair corners[4];   /* pull into the corner halos, to the up-right, up-left, down-right and down-left */
+  t_halo_pair push[4];      /* exchange_halos_push(), same order as pull */
+  float* push_cols[2];      /* what the push step streams into the left and right halo cols, see push_row_ops() */
+  MPI_Win win;              /* the lattice as a window, see exchange_halos_rma() */
+  MPI_Datatype put_targets[4];  /* where each pull halo lands in the window of the neighbour it is put to */
+  MPI_Group put_groups[2];  /* the left and right, then the down and up neighbours */
+  int    rma_ready;         /* win, put_targets and put_groups exist */
+  MPI_Request requests[16]; /* persistent pull exchange of timestep_overlapped(), see start_halos() */
+  int    nrequests;
+} t_halo_types;
+
+/* lattice of only the cells that matter to the fluid, see sparse_create() */
+typedef struct
+{
+  int    nfluid;        /* owned fluid cells, stored first */
+  int    nupdated;      /* then the owned obstacles next to fluid, which only rebound */
+  int    ncells;        /* then every halo cell, then a dummy for the cells that aren't stored */
+  int*   index;         /* index in the dense lattice of every stored cell but the dummy */
+  int*   source[NSPEEDS];  /* stored cell each speed of an updated cell streams from, none for speed 0 */
+  int*   accel;         /* stored fluid cells in the accelerated row */
+  int    naccel;
+  t_speed_arrays* cells[2];  /* the two lattices, cells[current] holds the current step */
+  int    current;
+  t_halo_pair halos[2][4];   /* pull exchange of each lattice, same order as t_halo_types.pull */
+} t_sparse;
+
+/* merged propagate/rebound/collision/av_velocity over cols [start, end) of row jj */
+typedef float (*t_merged_row_kernel)(const t_param params, t_speed_arrays*restrict cells, t_speed_arrays*restrict tmp_cells,
+                                     unsigned char*restrict obstacles, int jj, int start, int end);
+/* push step over cols [start, end) of row jj, see push_row_ops() */
+typedef float (*t_push_row_kernel)(const t_param params, t_speed_arrays*restrict cells, t_speed_arrays*restrict tmp_cells,
+                                   unsigned char*restrict obstacles, float* const* send_cols, int stream,
+                                   int jj, int start, int end);
+/* pull and collide the sparse fluid cells [start, end), returns their summed new velocity */
+typedef float (*t_sparse_fluid_kernel)(const t_param params, const t_sparse* sparse, t_speed_arrays*restrict cells,
+                                       t_speed_arrays*restrict tmp_cells, int start, int end);
+
 /*
 ** function prototypes
 */
 
 /* load params, allocate memory, load obstacles & initialise fluid particle densities */
-int initialise(const char* paramfile, const char* obstaclefile,
-               t_param* params, t_speed_arrays** cells_ptr, t_speed_arrays** tmp_cells_ptr,
-               int** obstacles_ptr, float** av_vels_ptr);
+int initialise(const char* obstaclefile, const t_decomp* decomp, const t_param params,
+               const t_param child_params, t_speed_arrays* child_cells, unsigned char* child_obstacles);
 
 /*
 ** The main calculation methods.
 ** timestep calls, in order, the functions:
 ** accelerate_flow(), propagate(), rebound() & collision()
 */
-int timestep(const t_param params, t_speed_arrays** cells, t_speed_arrays** tmp_cells, int* obstacles, int flag);
-float timestep_async(const t_param params, t_speed_arrays** cells, t_speed_arrays** tmp_cells, int* obstacles, int flag,
-                                           t_speed_arrays *tmp_cells2, int total_requests, MPI_Request ** requests);
-int accelerate_flow(const t_param params, t_speed_arrays* cells, int* obstacles, int flag);
+int timestep(const t_param params, t_speed_arrays** cells, t_speed_arrays** tmp_cells, unsigned char* obstacles, int flag);
+double timestep_overlapped(const t_decomp* decomp, const t_param params, t_speed_arrays* cells,
+                           t_speed_arrays* tmp_cells, unsigned char* obstacles);
+int accelerate_flow(const t_param params, t_speed_arrays* cells, unsigned char* obstacles, int flag);
+void accelerate_cols(const t_param params, t_speed_arrays* cells, unsigned char* obstacles, int row_start, int row_end,
+                     int start, int end, int increment);
+void timestep_blocked(const t_param params, t_speed_arrays** cells, t_speed_arrays** tmp_cells, unsigned char* obstacles,
+                      float* vels);
+void timestep_blocked_rows(const t_param params, t_speed_arrays** lattices, unsigned char* obstacles, int step,
+                           int start, int end, float* vels);
 int propagate(const t_param params, t_speed_arrays* cells, t_speed_arrays* tmp_cells, int flag);
-int rebound(const t_param params, t_speed_arrays* cells, t_speed_arrays* tmp_cells, int* obstacles, int flag);
-int collision(const t_param params, t_speed_arrays* cells, t_speed_arrays* tmp_cells, int* obstacles, int flag);
-float merged_timestep_ops(const t_param params, t_speed_arrays* cells, t_speed_arrays* tmp_cells, int* obstacles, int flag);
-
-int write_values(const t_param params, t_speed_arrays* cells, int* obstacles, float* av_vels);
+int rebound(const t_param params, t_speed_arrays* cells, t_speed_arrays* tmp_cells, unsigned char* obstacles, int flag);
+int collision(const t_param params, t_speed_arrays* cells, t_speed_arrays* tmp_cells, unsigned char* obstacles, int flag);
+float merged_timestep_ops(const t_param params, t_speed_arrays* cells, t_speed_arrays* tmp_cells, unsigned char* obstacles, int flag);
+float merged_block_ops(const t_param params, t_speed_arrays* cells, t_speed_arrays* tmp_cells, unsigned char* obstacles,
+                       int row_start, int row_end, int col_start, int col_end);
+float merged_row_ops(const t_param params, t_speed_arrays*restrict cells, t_speed_arrays*restrict tmp_cells,
+                     unsigned char*restrict obstacles, int jj, int start, int end);
+#if HAVE_X86_SIMD
+float merged_row_ops_avx2(const t_param params, t_speed_arrays*restrict cells, t_speed_arrays*restrict tmp_cells,
+                          unsigned char*restrict obstacles, int jj, int start, int end);
+float merged_row_ops_avx512(const t_param params, t_speed_arrays*restrict cells, t_speed_arrays*restrict tmp_cells,
+                            unsigned char*restrict obstacles, int jj, int start, int end);
+#endif
+const char* select_merged_kernel(void);
+void collide_cell(const t_param params, float* f);
+float cell_velocity(const float* f);
+float aa_even_step(const t_param params, t_speed_arrays* cells, unsigned char* obstacles);
+float aa_odd_step(const t_param params, t_speed_arrays* cells, unsigned char* obstacles);
+int accelerate_flow_aa_odd(const t_param params, t_speed_arrays* cells, unsigned char* obstacles);
+void aa_to_natural(const t_param params, t_speed_arrays* cells, t_speed_arrays* natural);
+
+int write_values(const t_decomp* decomp, const t_param params, const t_param child_params,
+                 t_speed_arrays* child_cells, unsigned char* child_obstacles, float* av_vels);
+void write_state_gathered(const t_decomp* decomp, const t_param params, const t_param child_params,
+                          t_speed_arrays* child_cells, unsigned char* child_obstacles);
+void write_state_mpiio(const t_decomp* decomp, const t_param params, const t_param child_params,
+                       t_speed_arrays* child_cells, unsigned char* child_obstacles);
+void cell_state(const t_param params, t_speed_arrays* cells, unsigned char* obstacles, int index, float* state);
 void initialise_params_from_file(const char* paramfile, t_param* params);
 
-/* finalise, including freeing up allocated memory */
-int finalise(const t_param* params, t_speed_arrays** cells_ptr, t_speed_arrays** tmp_cells_ptr,
-             int** obstacles_ptr, float** av_vels_ptr);
-
 /* Sum all the densities in the grid.
 ** The total should remain constant from one timestep to the next. */
 float total_density(const t_param params, t_speed_arrays* cells);
 
 /* compute average velocity */
-float av_velocity(const t_param params, t_speed_arrays* cells, int* obstacles, int flag);
+float av_velocity(const t_param params, t_speed_arrays* cells, unsigned char* obstacles, int flag);
+float av_velocity_block(const t_param params, t_speed_arrays* cells, unsigned char* obstacles, int row_start, int row_end,
+                        int start, int end, int increment);
 
 /* calculate Reynolds number */
-float calc_reynolds(const t_param params, t_speed_arrays* cells, int* obstacles);
+float calc_reynolds(const t_param params, t_speed_arrays* cells, unsigned char* obstacles);
 
 /* utility functions */
+void half_check(const t_param params, const float* av_vels, const char* ref_dir);
 void die(const char* message, const int line, const char* file);
 void usage(const char* exe);
 int calc_ncols_from_rank(int rank, int size, int nx);
-void output_state(const char* output_file, int step, t_speed_arrays *cells, int *obstacles, int nx, int ny);
+void create_decomp(t_decomp* decomp, int size, const t_param params, const char* obstaclefile, float obstacle_cost);
+void check_halo_depth(const t_decomp* decomp, const t_param params);
+void balanced_splits(const double* weights, int n, int parts, int* splits);
+void count_obstacles(const char* obstaclefile, const t_param params, int* col_obstacles, int* row_obstacles);
+float measure_obstacle_cost(const t_param params);
+float default_obstacle_cost(void);
+void report_imbalance(const t_decomp* decomp, const t_param child_params, unsigned char* child_obstacles, double compute_time);
+void decomp_block(const t_decomp* decomp, int rank, int* start_col, int* ncols, int* start_row, int* nrows);
+void checkpoint_init(t_checkpoint* checkpoint, int rank, const t_param params, const t_param child_params);
+void checkpoint_start(t_checkpoint* checkpoint, const t_decomp* decomp, const t_param params,
+                      const t_param child_params, t_speed_arrays* child_cells, float* av_vels, int tt);
+void checkpoint_finish(t_checkpoint* checkpoint, int wait);
+int checkpoint_restore(t_checkpoint* checkpoint, const t_decomp* decomp, const t_param params,
+                       const t_param child_params, t_speed_arrays* child_cells, float* av_vels);
+float checkpoint_obstacle_cost(void);
+void vels_init(t_vels* vels, const t_param params, int rank, int tot_u);
+float* vels_at(t_vels* vels, int tt);
+void vels_reserve(t_vels* vels, int tt, int n);
+void vels_flush(t_vels* vels, int tt, int wait);
+void vels_land(t_vels* vels);
+MPI_Datatype cells_column_type(const t_speed_arrays* cells, int offset, int nrows, int row_stride);
+MPI_Datatype obstacles_column_type(int nrows, int row_stride);
+void gather_rows(const t_decomp* decomp, const t_param params, const t_param child_params,
+                 t_speed_arrays* child_cells, unsigned char* child_obstacles, int row, int nrows,
+                 t_speed_arrays* band_cells, unsigned char* band_obstacles);
+void output_state(const char* output_file, int step, t_speed_arrays *cells, unsigned char *obstacles, int nx, int ny);
 void test_vels(const char* output_file, float *vels, int steps);
-void exchange_obstacles(int rank, int size, t_param child_params, int *child_obstacles,
-                      int* sbuffer_obstacles, int* rbuffer_obstacles);
-void exchange_halos(int rank, int size, t_param child_params, t_speed_arrays *child_cells,
-                      float* sbuffer_cells, float* rbuffer_cells);
-void exchange_halos_async(MPI_Request** requests, int rank, int size, t_param child_params, t_speed_arrays *child_cells,
-                      float* sbuffer_cells1, float* rbuffer_cells1,
-                      float* sbuffer_cells2, float* rbuffer_cells2);
+void exchange_obstacles(const t_decomp* decomp, t_param child_params, unsigned char *child_obstacles);
+MPI_Datatype halo_type(t_param child_params, t_speed_arrays* cells, const int* speeds, int nspeeds,
+                       int col, int row, int width);
+MPI_Datatype edge_halo_type(t_param child_params, t_speed_arrays* cells, const int* speeds, int nspeeds,
+                            int col, int row, int len, int stride);
+const t_halo_types* halo_types(t_param child_params, t_speed_arrays* cells);
+const t_halo_types* start_halos(const t_decomp* decomp, t_param child_params, t_speed_arrays* cells);
+void free_halo_types(void);
+void sendrecv_halos(const t_decomp* decomp, const t_halo_pair* pairs);
+void exchange_halos(const t_decomp* decomp, t_param child_params, t_speed_arrays *child_cells);
+void check_halos(const t_decomp* decomp, t_param child_params, t_speed_arrays* cells);
+void exchange_halos_aa_reverse(const t_decomp* decomp, t_param child_params, t_speed_arrays *child_cells);
+void exchange_halos_push(const t_decomp* decomp, t_param child_params, t_speed_arrays *child_cells);
+void neighbour_shapes(t_decomp* decomp, t_param child_params);
+void shared_decomp(t_decomp* decomp);
+void exchange_halos_shared(const t_decomp* decomp, t_param child_params, t_speed_arrays *child_cells);
+void shared_fence(const t_decomp* decomp, t_speed_arrays* cells);
+void shared_pull(const t_decomp* decomp, t_param child_params, t_speed_arrays* cells, int dir);
+void exchange_halos_rma(const t_decomp* decomp, t_param child_params, t_speed_arrays *child_cells);
+void rma_halo_init(const t_decomp* decomp, t_param child_params, t_halo_types* halo);
+MPI_Datatype window_halo_type(int nx, int ny, int pitch, const int* speeds, int nspeeds, int col, int row, int width);
+void push_prologue(const t_param params, t_speed_arrays* cells, t_speed_arrays* tmp_cells);
+float push_timestep_ops(const t_param params, t_speed_arrays*restrict cells, t_speed_arrays*restrict tmp_cells,
+                        unsigned char*restrict obstacles, int stream);
+float push_row_ops(const t_param params, t_speed_arrays*restrict cells, t_speed_arrays*restrict tmp_cells,
+                   unsigned char*restrict obstacles, float* const* send_cols, int stream, int jj, int start, int end);
+#if HAVE_X86_SIMD
+float push_row_ops_avx2(const t_param params, t_speed_arrays*restrict cells, t_speed_arrays*restrict tmp_cells,
+                        unsigned char*restrict obstacles, float* const* send_cols, int stream, int jj, int start, int end);
+#endif
+void sparse_create(t_sparse* sparse, const t_param params, t_speed_arrays* cells, unsigned char* obstacles);
+MPI_Datatype sparse_halo_type(t_speed_arrays* cells, const int* speeds, int nspeeds, const int* positions, int n);
+void sparse_accelerate(const t_param params, t_sparse* sparse);
+float sparse_timestep(const t_param params, t_sparse* sparse);
+float sparse_fluid_ops(const t_param params, const t_sparse* sparse, t_speed_arrays*restrict cells,
+                       t_speed_arrays*restrict tmp_cells, int start, int end);
+#if HAVE_X86_SIMD
+float sparse_fluid_ops_avx2(const t_param params, const t_sparse* sparse, t_speed_arrays*restrict cells,
+                            t_speed_arrays*restrict tmp_cells, int start, int end);
+float sparse_fluid_ops_avx512(const t_param params, const t_sparse* sparse, t_speed_arrays*restrict cells,
+                              t_speed_arrays*restrict tmp_cells, int start, int end);
+#endif
+t_speed_arrays* sparse_to_dense(const t_param params, const t_sparse* sparse);
+void sparse_free(t_sparse* sparse);
+t_speed_arrays* create_half_speed_arrays(t_param params);
+float half_bias(const t_param params, int kk);
+unsigned short half_encode(float value);
+float half_decode(unsigned short value);
+void half_from_dense(const t_param params, const t_speed_arrays* cells, t_speed_arrays* half);
+t_speed_arrays* half_to_dense(const t_param params, const t_speed_arrays* half);
+void half_accelerate(const t_param params, t_speed_arrays* cells, unsigned char* obstacles);
+float half_timestep_ops(const t_param params, t_speed_arrays*restrict cells, t_speed_arrays*restrict tmp_cells,
+                        unsigned char*restrict obstacles);
+float merged_row_ops_half(const t_param params, t_speed_arrays*restrict cells, t_speed_arrays*restrict tmp_cells,
+                          unsigned char*restrict obstacles, int jj, int start, int end);
+#if HAVE_X86_SIMD
+float merged_row_ops_half_avx2(const t_param params, t_speed_arrays*restrict cells, t_speed_arrays*restrict tmp_cells,
+                               unsigned char*restrict obstacles, int jj, int start, int end);
+#endif
 void swap_floats(float *var1, float *var2);
 void swap_cells(t_speed *var1, t_speed *var2);
 void swap_cells_arrays(t_speed_arrays *var1, t_speed_arrays *var2, int coord1, int coord2);
 int start_process_grid_from(int size, int rank, int n);
 int min(int a, int b);
+int max(int a, int b);
 t_speed_arrays* create_t_speed_arrays(t_param params);
+t_speed_arrays* alloc_speed_arena(int ncells);
+size_t speed_stride(int ncells);
+t_speed_arrays* create_shared_speed_arrays(t_param params, const t_decomp* decomp);
+int row_pitch(int nx, int padding);
 void free_t_speed_arrays(t_speed_arrays* obj);
 
+/* kernel used by merged_timestep_ops, chosen by select_merged_kernel() */
+t_merged_row_kernel merged_row_kernel = merged_row_ops;
+/* kernel used by sparse_timestep, chosen along with it */
+t_sparse_fluid_kernel sparse_fluid_kernel = sparse_fluid_ops;
+/* kernel used by half_timestep_ops, chosen along with it */
+t_merged_row_kernel half_row_kernel = merged_row_ops_half;
+/* kernel used by push_timestep_ops, chosen along with it */
+t_push_row_kernel push_row_kernel = push_row_ops;
+
+/* halo datatypes of the (at most two) lattices exchanged so far, see halo_types() */
+t_halo_types halo_type_cache[2];
+int halo_type_cache_len = 0;
 
 /*
 ** main program:
@@ -161,10 +428,7 @@ int main(int argc, char* argv[])
   char*    paramfile = NULL;    /* name of the input parameter file */
   char*    obstaclefile = NULL; /* name of a the input obstacle file */
   t_param  params;              /* struct to hold parameter values */
-  t_speed_arrays* cells     = NULL;    /* grid containing fluid densities */
-  t_speed_arrays* tmp_cells = NULL;    /* scratch space */
-  int*     obstacles = NULL;    /* grid indicating which cells are blocked */
-  float* av_vels   = NULL;     /* a record of the av. velocity computed for each timestep */
+  float* av_vels   = NULL;     /* a record of the av. velocity computed for each timestep, rank 0 only */
   struct timeval timstr;        /* structure to hold elapsed time */
   struct rusage ru;             /* structure to hold CPU time--system and user */
   double tic, toc;              /* floating point numbers to calculate elapsed wallclock time */
@@ -179,26 +443,24 @@ int main(int argc, char* argv[])
   char hostname[MPI_MAX_PROCESSOR_NAME];  /* character array to hold hostname running process */
   t_speed_arrays *child_cells;
   t_speed_arrays *child_tmp_cells;
-  int *child_obstacles;
-  float *child_vels;
-  float *rbuffer_vels;
-  float *sbuffer_cells1;
-  float *rbuffer_cells1;
-  int *sbuffer_obstacles1;
-  int *rbuffer_obstacles1;
-  float *sbuffer_cells2;
-  float *rbuffer_cells2;
-  t_speed_arrays *old_cell_vals;
-  MPI_Request** requests;
-
-  /* initialise our MPI environment */
-  MPI_Init( &argc, &argv );
+  unsigned char *child_obstacles;
+  t_vels vels;
+
+  /* initialise our MPI environment, only the master thread makes MPI calls */
+  int thread_support;
+  MPI_Init_thread( &argc, &argv, MPI_THREAD_FUNNELED, &thread_support );
 
   /* check whether the initialisation was successful */
   MPI_Initialized(&flag);
   if ( flag != 1 ) {
     MPI_Abort(MPI_COMM_WORLD,EXIT_FAILURE);
   }
+#ifdef _OPENMP
+  if ( thread_support < MPI_THREAD_FUNNELED && omp_get_max_threads() > 1 ) {
+    fprintf(stderr, "MPI library does not support MPI_THREAD_FUNNELED\n");
+    MPI_Abort(MPI_COMM_WORLD,EXIT_FAILURE);
+  }
+#endif
 
   /* determine the hostname */
   MPI_Get_processor_name(hostname,&strlen);
@@ -214,90 +476,201 @@ int main(int argc, char* argv[])
   MPI_Comm_rank( MPI_COMM_WORLD, &rank );
 
   /* parse the command line */
-  if (argc != 3)
+  int restart = 0;
+  int row_padding = ROW_PADDING;
+  int rma_halos = 0;
+  float obstacle_cost = -2.f;  /* fixed for the kernels unless given, -1 to measure it */
+  const char* half_check_dir = NULL;  /* output of an fp32 run to check a 16 bit run against */
+  if (argc < 3) usage(argv[0]);
+  for (int arg = 3; arg < argc; ++arg)
   {
-    usage(argv[0]);
+    if (strcmp(argv[arg], "--restart") == 0)
+    {
+      restart = 1;
+    }
+    else if (strcmp(argv[arg], "--halos=sendrecv") == 0)
+    {
+      rma_halos = 0;
+    }
+    else if (strcmp(argv[arg], "--halos=fence") == 0)
+    {
+      rma_halos = 1;
+    }
+    else if (strcmp(argv[arg], "--halos=pscw") == 0)
+    {
+      rma_halos = 2;
+    }
+    else if (strcmp(argv[arg], "--obstacle-cost=measure") == 0)
+    {
+      obstacle_cost = -1.f;
+    }
+    else if (strncmp(argv[arg], "--obstacle-cost=", 16) == 0)
+    {
+      if (sscanf(argv[arg] + 16, "%f", &obstacle_cost) != 1 || obstacle_cost < 0.f) usage(argv[0]);
+    }
+    else if (strncmp(argv[arg], "--half-check=", 13) == 0)
+    {
+      half_check_dir = argv[arg] + 13;
+    }
+    else if (sscanf(argv[arg], "--row-padding=%d", &row_padding) != 1 || row_padding < 0)
+    {
+      usage(argv[0]);
+    }
   }
-  else
-  {
-    paramfile = argv[1];
-    obstaclefile = argv[2];
+  paramfile = argv[1];
+  obstaclefile = argv[2];
+
+  if(half_check_dir && (!HALF_STORAGE || BINARY_OUTPUT)) {
+    die("--half-check compares the text output of a 16 bit run", __LINE__, __FILE__);
   }
 
   initialise_params_from_file(paramfile, &params);
   t_param child_params;
   child_params = params;
 
-  //Work out child params
-  int child_cols = calc_ncols_from_rank(rank, size, params.nx);
-  child_params.nx = child_cols + 2; // add 2 halo cols
+  const char* kernel_name = select_merged_kernel();
+  if(obstacle_cost == -2.f) obstacle_cost = default_obstacle_cost();
+  //only the master places the splits, from the cost they were saved with
+  if(restart && LOAD_BALANCE && rank == 0) obstacle_cost = checkpoint_obstacle_cost();
+
+  //Work out the process grid and child params
+  t_decomp decomp;
+  create_decomp(&decomp, size, params, obstaclefile, obstacle_cost);
+  check_halo_depth(&decomp, params);
+  decomp.rma_halos = rma_halos;
+  if(SPARSE_LATTICE && (AA_PATTERN || ASYNC_HALOS || HALO_DEPTH > 1)) {
+    die("the sparse lattice needs the synchronous pull step with single halos", __LINE__, __FILE__);
+  }
+  if(HALF_STORAGE && (SPARSE_LATTICE || AA_PATTERN || ASYNC_HALOS || HALO_DEPTH > 1)) {
+    die("16 bit storage needs the synchronous pull step with single halos", __LINE__, __FILE__);
+  }
+  //8 bit mantissas put av_vels about 36% off the fp32 run on 128x128
+  if(HALF_STORAGE == 1) {
+    die("bf16 storage is too coarse for this problem, use HALF_STORAGE 3", __LINE__, __FILE__);
+  }
+  if(PUSH_STREAMING && (SPARSE_LATTICE || AA_PATTERN || ASYNC_HALOS || HALF_STORAGE || HALO_DEPTH > 1)) {
+    die("push streaming replaces the synchronous pull step with single halos", __LINE__, __FILE__);
+  }
+  if(SHARED_HALOS && (SPARSE_LATTICE || AA_PATTERN || ASYNC_HALOS || HALF_STORAGE || PUSH_STREAMING)) {
+    die("shared memory halos only replace the synchronous pull exchange", __LINE__, __FILE__);
+  }
+  if(rma_halos && (SPARSE_LATTICE || AA_PATTERN || ASYNC_HALOS || HALF_STORAGE || PUSH_STREAMING || SHARED_HALOS)) {
+    die("one-sided halos only replace the synchronous pull exchange", __LINE__, __FILE__);
+  }
+  child_params.halo_cols = HALO_DEPTH;
+  child_params.nx = decomp.ncols + 2*HALO_DEPTH; // add the halo cols
+  //ghost rows even for a single row of processes, which fills them from itself,
+  //so the kernels never wrap an index
+  child_params.halo_rows = HALO_DEPTH;
+  child_params.ny = decomp.nrows + 2*HALO_DEPTH; // add the halo rows
+  child_params.pitch = row_pitch(child_params.nx, row_padding);
+  //halo copies of the accelerated row get accelerated too, see accelerate_flow()
+  child_params.accel_row = ((params.ny - 2) - decomp.start_row + child_params.halo_rows) % params.ny;
+  if(child_params.accel_row >= child_params.ny) {
+    child_params.accel_row = -1;
+  }
+  neighbour_shapes(&decomp, child_params);
   //Initialise child memory
-  rbuffer_vels = (float*) calloc(params.maxIters, sizeof(float));
-  child_cells = create_t_speed_arrays(child_params);
-  child_tmp_cells = create_t_speed_arrays(child_params);
-  child_obstacles = (int*) calloc((child_params.ny * child_params.nx), sizeof(int));
-  child_vels = (float*) calloc(params.maxIters, sizeof(float));
-  sbuffer_cells1 = (float*) calloc(params.ny * NSPEEDS, sizeof(float));
-  rbuffer_cells1 = (float*) calloc(params.ny * NSPEEDS, sizeof(float));
-  sbuffer_obstacles1 = (int *) calloc(params.ny, sizeof(int));
-  rbuffer_obstacles1 = (int *) calloc(params.ny, sizeof(int));
-  sbuffer_cells2 = (float*) calloc(params.ny * NSPEEDS, sizeof(float));
-  rbuffer_cells2 = (float*) calloc(params.ny * NSPEEDS, sizeof(float));
-  old_cell_vals = create_t_speed_arrays(child_params);
-  requests = (MPI_Request **) malloc(4*sizeof(MPI_Request*));  // for async halo exchange
+  if(SHARED_HALOS) {
+    shared_decomp(&decomp);
+    child_cells = create_shared_speed_arrays(child_params, &decomp);
+    child_tmp_cells = create_shared_speed_arrays(child_params, &decomp);
+  } else {
+    child_cells = create_t_speed_arrays(child_params);
+    child_tmp_cells = (AA_PATTERN || HALF_STORAGE) ? NULL : create_t_speed_arrays(child_params);
+  }
+  /* one byte per cell, the vector kernels widen 8 or 16 of them into a lane mask */
+  child_obstacles = (unsigned char*) calloc((child_params.ny * child_params.pitch), sizeof(unsigned char));
 
   if(rank == 0) {
     printf("Number of processes: %d\n", size);
-    if(ASYNC_HALOS) printf("Asynchronous halo exchange.\n");
+    printf("Process grid: %d x %d\n", decomp.dims[0], decomp.dims[1]);
+    if(LOAD_BALANCE) printf("Load balancing, obstacle cell cost: %.3f of a fluid cell\n", decomp.obstacle_cost);
+    printf("Col splits:");
+    for(int i = 0; i <= decomp.dims[0]; ++i) printf(" %d", decomp.col_splits[i]);
+    printf("\nRow splits:");
+    for(int i = 0; i <= decomp.dims[1]; ++i) printf(" %d", decomp.row_splits[i]);
+    printf("\n");
+#ifdef _OPENMP
+    printf("Threads per process: %d\n", omp_get_max_threads());
+#endif
+    if(ASYNC_HALOS && !AA_PATTERN) printf("Overlapping the halo exchange with the interior.\n");
     if(SPREAD_COLS_EVENLY) printf("Spreading remainder cols evenly.\n");
     if(MERGE_TIMESTEP) printf("Merging propagate, rebound, collision and av_velocity.\n");
     if(REDUCE_HALO_SPEED_ECHANGE) printf("Using reduced halo exchange.\n");
-    /* initialise our data structures and load values from file */
-    initialise(paramfile, obstaclefile, &params, &cells, &tmp_cells, &obstacles, &av_vels);
-
-    //allocate memory for async send buffs
-    float** send_buffer_cells = (float**) malloc(size * sizeof(float*));
-    int** send_buffer_obstacles = (int**) malloc(size * sizeof(int*));
-    for(int process = 0; process < size; ++process) {
-      int process_cols = calc_ncols_from_rank(process, size, params.nx);
-      send_buffer_cells[process] = (float*) malloc(params.ny * process_cols * NSPEEDS * sizeof(float));
-      send_buffer_obstacles[process] = (int*) malloc(params.ny * process_cols * sizeof(int));
-    }
-
-    //Send data to children and itself
-    for(int process = 0; process < size; ++process) {
-      int current_child_cols = calc_ncols_from_rank(process, size, params.nx);
-      int start_from = start_process_grid_from(size, process, params.nx);
-      //printf("rank: %d, start from: %d, cols: %d\n", process, start_from, current_child_cols);
-      for(int col = start_from, child_col = 0; col < start_from + current_child_cols; ++col, ++child_col) {
-        //Fill send buffers
-        for(int row = 0; row < params.ny; ++row) {
-          send_buffer_obstacles[process][child_col*params.ny + row] = obstacles[row*params.nx + col];
-          for(int speed = 0; speed < NSPEEDS; ++speed) {
-            send_buffer_cells[process][child_col*params.ny*NSPEEDS + row*NSPEEDS + speed] = cells->speeds[speed][row*params.nx + col];
-          }
-        }
-        //Send data
-        MPI_Request send_request;
-        MPI_Isend(&send_buffer_cells[process][child_col*params.ny*NSPEEDS], params.ny*NSPEEDS, MPI_FLOAT, process, 0, MPI_COMM_WORLD, &send_request);
-        MPI_Isend(&send_buffer_obstacles[process][child_col*params.ny], params.ny, MPI_INT, process, 1, MPI_COMM_WORLD, &send_request);
-      }
-    }
-    // Done sending stuff
+    if(HALO_CHECK) printf("Checking the halos against a full exchange every %d steps.\n", HALO_CHECK);
+    if(AA_PATTERN) printf("Using AA-pattern in-place streaming.\n");
+    if(PUSH_STREAMING) printf("Using push streaming.\n");
+    if(SHARED_HALOS) printf("Reading same-node halos from shared memory windows.\n");
+    if(rma_halos) printf("Putting halos one-sided, synchronised by %s.\n", (rma_halos == 1) ? "fences" : "PSCW");
+    if(HALO_DEPTH > 1) printf("Halo depth %d, exchanging halos every %d steps.\n", HALO_DEPTH, HALO_DEPTH);
+    if(TEMPORAL_BLOCKING) printf("Temporal blocking over tiles of %d rows.\n", TILE_ROWS);
+    if(SPARSE_LATTICE) printf("Storing only the cells next to fluid.\n");
+    if(HALF_STORAGE) printf("Storing the lattice as %s.\n",
+                            (HALF_STORAGE == 1) ? "bf16" : (HALF_STORAGE == 2) ? "fp16" : "fp16 deviations from rest");
+    printf("Merged kernel: %s\n", kernel_name);
+    printf("Row pitch: %d cells for %d cols\n", child_params.pitch, child_params.nx);
+    printf("Reducing velocities to rank 0 every %d steps.\n", VELS_BATCH);
   }
-  //Receive data from master
-  for(int col = 1; col < child_params.nx-1; ++col) {
-    MPI_Recv(rbuffer_cells1, child_params.ny*NSPEEDS, MPI_FLOAT, 0, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-    MPI_Recv(rbuffer_obstacles1, child_params.ny, MPI_INT, 0, 1, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-    for(int row = 0; row < child_params.ny; ++row) {
-      child_obstacles[row*child_params.nx + col] = rbuffer_obstacles1[row];
-      for(int speed = 0; speed < NSPEEDS; ++speed) {
-        child_cells->speeds[speed][row*child_params.nx + col] = rbuffer_cells1[row*NSPEEDS + speed];
+  if(VELS_BATCH < HALO_DEPTH) die("temporal blocking needs VELS_BATCH to be at least HALO_DEPTH", __LINE__, __FILE__);
+  /* every child initialises its own block and loads its own obstacles */
+  initialise(obstaclefile, &decomp, params, child_params, child_cells, child_obstacles);
+  //obstacles don't ever change values, so send here for halos once
+  exchange_obstacles(&decomp, child_params, child_obstacles);
+
+  //count the fluid cells of the whole grid
+  int child_tot_u = 0;
+  for(int row = child_params.halo_rows; row < child_params.ny - child_params.halo_rows; ++row) {
+    for(int col = child_params.halo_cols; col < child_params.nx - child_params.halo_cols; ++col) {
+      if(!child_obstacles[row*child_params.pitch + col]) {
+        ++child_tot_u;
       }
     }
   }
-  //obstacles don't ever change values, so send here for halos once
-  exchange_obstacles(rank, size, child_params, child_obstacles, sbuffer_obstacles1, rbuffer_obstacles1);
+  int tot_u = 0;
+  MPI_Reduce(&child_tot_u, &tot_u, 1, MPI_INT, MPI_SUM, 0, MPI_COMM_WORLD);
+
+  vels_init(&vels, params, rank, tot_u);
+  av_vels = vels.av_vels;
+
+  t_checkpoint checkpoint;
+  checkpoint_init(&checkpoint, rank, params, child_params);
+  int start_tt = 0;
+  if(restart) {
+    start_tt = checkpoint_restore(&checkpoint, &decomp, params, child_params, child_cells, av_vels);
+    //a run killed mid checkpoint can leave processes one checkpoint apart
+    int newest_tt;
+    MPI_Allreduce(&start_tt, &newest_tt, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+    if(newest_tt != start_tt) die("checkpoints of the processes are from different iterations", __LINE__, __FILE__);
+    if(rank == 0) printf("Restarting from iteration %d\n", start_tt);
+    //the velocities up to it are in rank 0's checkpoint
+    vels.start = vels.landed = start_tt;
+  }
+  t_sparse sparse;
+  if(SPARSE_LATTICE) {
+    sparse_create(&sparse, child_params, child_cells, child_obstacles);
+    //the dense lattices are only built again for checkpoints and the output
+    free_t_speed_arrays(child_cells);
+    free_t_speed_arrays(child_tmp_cells);
+    child_cells = child_tmp_cells = NULL;
+  }
+  if(PUSH_STREAMING && !restart) {
+    //a push checkpoint is streamed already, a fresh lattice still needs streaming once
+    accelerate_flow(child_params, child_cells, child_obstacles, 2);
+    exchange_halos(&decomp, child_params, child_cells);
+    push_prologue(child_params, child_cells, child_tmp_cells);
+    t_speed_arrays *cells_ptr = child_cells;
+    child_cells = child_tmp_cells;
+    child_tmp_cells = cells_ptr;
+  }
+  if(HALF_STORAGE) {
+    //child_cells is 16 bit from here on, widened again for checkpoints and the output
+    t_speed_arrays* dense_cells = child_cells;
+    child_cells = create_half_speed_arrays(child_params);
+    child_tmp_cells = create_half_speed_arrays(child_params);
+    half_from_dense(child_params, dense_cells, child_cells);
+    free_t_speed_arrays(dense_cells);
+  }
 
   /* iterate for maxIters timesteps */
   gettimeofday(&timstr, NULL);
@@ -307,136 +680,136 @@ int main(int argc, char* argv[])
   sprintf(output_file, "final_state_size_%d.txt", size);
   fclose(fopen(output_file, "w"));
 
-  for (int tt = 0; tt < params.maxIters; tt++)
+  double compute_time = 0.0;   /* time spent in the kernels, excluding communication */
+  double compute_tic;
+  for (int tt = start_tt; tt < params.maxIters; tt++)
   {
     //output_state(file_name, tt, process_cells, process_obstacles, process_params.nx, process_params.ny);
-    if(rank == 0 && tt % 500 == 0) printf("iteration: %d\n", tt);
-
-    if(!ASYNC_HALOS) {
-      if(rank == 0 && tt == 0) printf("Flag: 2\n");
-      //Exchange halos
-      exchange_halos(rank, size, child_params, child_cells, sbuffer_cells1, rbuffer_cells1);
-      //now do computations
-      //timestep(child_params, &child_cells, &child_tmp_cells, child_obstacles, 2);
-      timestep_async(child_params, &child_cells, &child_tmp_cells, child_obstacles, 2, old_cell_vals, 0, 0);
-      child_vels[tt] = av_velocity(child_params, child_cells, child_obstacles, 2);
-    } else {
-      int total_requests = 4;  // total async halo exchange requests
-      for(int i = 0; i < total_requests; ++i) {
-        requests[i] = (MPI_Request*) malloc(sizeof(MPI_Request));
-      }
-      exchange_halos_async(requests, rank, size, child_params, child_cells,
-                                                      sbuffer_cells1, rbuffer_cells1,
-                                                      sbuffer_cells2, rbuffer_cells2);
-
-      //now do computations
-      //timestep(child_params, &child_cells, &child_tmp_cells, child_obstacles, 0);
-      if(MERGE_TIMESTEP) {
-        child_vels[tt] = timestep_async(child_params, &child_cells, &child_tmp_cells, child_obstacles, 0, old_cell_vals, total_requests, requests);
+    if(rank == 0 && tt % 500 == 0) {
+      if(vels.landed > 0) {
+        printf("iteration: %d, av velocity %.12E at %d\n", tt, av_vels[vels.landed - 1], vels.landed - 1);
       } else {
-        timestep_async(child_params, &child_cells, &child_tmp_cells, child_obstacles, 0, old_cell_vals, total_requests, requests);
-        child_vels[tt] = av_velocity(child_params, child_cells, child_obstacles, 0);
-      }
-
-      //synchronise
-      for(int i = 0; i < total_requests; ++i) {
-        MPI_Request* current_request = requests[i];
-        MPI_Wait(current_request, MPI_STATUS_IGNORE);
+        printf("iteration: %d\n", tt);
       }
-      int speeds_to_recv = REDUCE_HALO_SPEED_ECHANGE ? 3 : NSPEEDS;
-      //populate left col
-      for(int row = 0; row < child_params.ny; ++row) {
-        //t_speed speeds;
-        if(REDUCE_HALO_SPEED_ECHANGE) {
-          if(MERGE_TIMESTEP) {
-            child_tmp_cells->speeds[1][row*child_params.nx] = rbuffer_cells2[row*speeds_to_recv + 0];
-            child_tmp_cells->speeds[5][row*child_params.nx] = rbuffer_cells2[row*speeds_to_recv + 1];
-            child_tmp_cells->speeds[8][row*child_params.nx] = rbuffer_cells2[row*speeds_to_recv + 2];
-          } else {
-            child_cells->speeds[1][row*child_params.nx] = rbuffer_cells2[row*speeds_to_recv + 0];
-            child_cells->speeds[5][row*child_params.nx] = rbuffer_cells2[row*speeds_to_recv + 1];
-            child_cells->speeds[8][row*child_params.nx] = rbuffer_cells2[row*speeds_to_recv + 2];
-          }
-        } else {
-            for(int speed = 0; speed < NSPEEDS; ++speed) {
-              //speeds.speeds[speed] = rbuffer_cells2[row*NSPEEDS + speed];
-              if(MERGE_TIMESTEP) {
-                  child_tmp_cells->speeds[speed][row*child_params.nx] = rbuffer_cells2[row*speeds_to_recv + speed];
-              } else {
-                  child_cells->speeds[speed][row*child_params.nx] = rbuffer_cells2[row*speeds_to_recv + speed];
-              }
-            }
-        }
+    }
+    //room for the velocities of every step the body may take
+    vels_reserve(&vels, tt, child_params.halo_cols);
+
+    if(SPARSE_LATTICE) {
+      compute_tic = MPI_Wtime();
+      sparse_accelerate(child_params, &sparse);
+      compute_time += MPI_Wtime() - compute_tic;
+      sendrecv_halos(&decomp, sparse.halos[sparse.current]);
+      compute_tic = MPI_Wtime();
+      *vels_at(&vels, tt) = sparse_timestep(child_params, &sparse);
+      compute_time += MPI_Wtime() - compute_tic;
+    } else if(HALF_STORAGE) {
+      compute_tic = MPI_Wtime();
+      half_accelerate(child_params, child_cells, child_obstacles);
+      compute_time += MPI_Wtime() - compute_tic;
+      exchange_halos(&decomp, child_params, child_cells);
+      compute_tic = MPI_Wtime();
+      *vels_at(&vels, tt) = half_timestep_ops(child_params, child_cells, child_tmp_cells, child_obstacles);
+      t_speed_arrays *cells_ptr = child_cells;
+      child_cells = child_tmp_cells;
+      child_tmp_cells = cells_ptr;
+      compute_time += MPI_Wtime() - compute_tic;
+    } else if(PUSH_STREAMING) {
+      //the last step collides in place, which leaves the natural layout for the output
+      int stream = (tt + 1 < params.maxIters);
+      compute_tic = MPI_Wtime();
+      *vels_at(&vels, tt) = push_timestep_ops(child_params, child_cells, child_tmp_cells, child_obstacles, stream);
+      t_speed_arrays *cells_ptr = child_cells;
+      child_cells = child_tmp_cells;
+      child_tmp_cells = cells_ptr;
+      compute_time += MPI_Wtime() - compute_tic;
+      if(stream) exchange_halos_push(&decomp, child_params, child_cells);
+    } else if(AA_PATTERN) {
+      if(tt % 2 == 0) {
+        //accelerate before the exchange, so the halos arrive accelerated
+        compute_tic = MPI_Wtime();
+        accelerate_flow(child_params, child_cells, child_obstacles, 2);
+        compute_time += MPI_Wtime() - compute_tic;
+        exchange_halos(&decomp, child_params, child_cells);
+        compute_tic = MPI_Wtime();
+        *vels_at(&vels, tt) = aa_even_step(child_params, child_cells, child_obstacles);
+        compute_time += MPI_Wtime() - compute_tic;
+      } else {
+        compute_tic = MPI_Wtime();
+        accelerate_flow_aa_odd(child_params, child_cells, child_obstacles);
+        compute_time += MPI_Wtime() - compute_tic;
+        exchange_halos_aa_reverse(&decomp, child_params, child_cells);
+        compute_tic = MPI_Wtime();
+        *vels_at(&vels, tt) = aa_odd_step(child_params, child_cells, child_obstacles);
+        compute_time += MPI_Wtime() - compute_tic;
       }
-      //populate right col
-      for(int row = 0; row < child_params.ny; ++row) {
-        //t_speed speeds;
-        if(REDUCE_HALO_SPEED_ECHANGE) {
-          if(MERGE_TIMESTEP) {
-            child_tmp_cells->speeds[3][row*child_params.nx + (child_params.nx - 1)] = rbuffer_cells1[row*speeds_to_recv + 0];
-            child_tmp_cells->speeds[6][row*child_params.nx + (child_params.nx - 1)] = rbuffer_cells1[row*speeds_to_recv + 1];
-            child_tmp_cells->speeds[7][row*child_params.nx + (child_params.nx - 1)] = rbuffer_cells1[row*speeds_to_recv + 2];
-          } else {
-            child_cells->speeds[3][row*child_params.nx + (child_params.nx - 1)] = rbuffer_cells1[row*speeds_to_recv + 0];
-            child_cells->speeds[6][row*child_params.nx + (child_params.nx - 1)] = rbuffer_cells1[row*speeds_to_recv + 1];
-            child_cells->speeds[7][row*child_params.nx + (child_params.nx - 1)] = rbuffer_cells1[row*speeds_to_recv + 2];
-          }
-        } else {
-          for(int speed = 0; speed < NSPEEDS; ++speed) {
-            //speeds.speeds[speed] = rbuffer_cells1[row*NSPEEDS + speed];
-            if(MERGE_TIMESTEP) {
-                child_tmp_cells->speeds[speed][row*child_params.nx + (child_params.nx - 1)] = rbuffer_cells1[row*speeds_to_recv + speed];
-            } else {
-                child_cells->speeds[speed][row*child_params.nx + (child_params.nx - 1)] = rbuffer_cells1[row*speeds_to_recv + speed];
-            }
-          }
-        }
+    } else if(!ASYNC_HALOS) {
+      if(rank == 0 && tt == 0) printf("Flag: 2\n");
+      //accelerate before the exchange, so the halos arrive accelerated and only
+      //the speeds streaming into the block need to be sent
+      compute_tic = MPI_Wtime();
+      accelerate_flow(child_params, child_cells, child_obstacles, 2);
+      compute_time += MPI_Wtime() - compute_tic;
+      //Exchange halos on the first of every HALO_DEPTH steps, substep s then
+      //recomputes the halo cells at least s away from the edge of the lattice
+      int substep = tt % child_params.halo_cols + 1;
+      if(substep == 1) {
+        exchange_halos(&decomp, child_params, child_cells);
+        if(HALO_CHECK && tt % max(HALO_CHECK, 1) == 0) check_halos(&decomp, child_params, child_cells);
       }
-
       //now do computations
-      //timestep(child_params, &child_cells, &child_tmp_cells, child_obstacles, 1);
-      if(MERGE_TIMESTEP) {
-        child_vels[tt] += timestep_async(child_params, &child_cells, &child_tmp_cells, child_obstacles, 1, old_cell_vals, total_requests, requests);
+      compute_tic = MPI_Wtime();
+      if(TEMPORAL_BLOCKING && substep == 1 && tt + child_params.halo_cols <= params.maxIters) {
+        //all steps up to the next exchange at once, a leftover partial cycle goes step by step
+        timestep_blocked(child_params, &child_cells, &child_tmp_cells, child_obstacles, vels_at(&vels, tt));
+        tt += child_params.halo_cols - 1;
       } else {
-        timestep_async(child_params, &child_cells, &child_tmp_cells, child_obstacles, 1, old_cell_vals, total_requests, requests);
-        child_vels[tt] += av_velocity(child_params, child_cells, child_obstacles, 1);
+        //timestep(child_params, &child_cells, &child_tmp_cells, child_obstacles, 2);
+        merged_block_ops(child_params, child_cells, child_tmp_cells, child_obstacles,
+                         substep, child_params.ny - substep, substep, child_params.nx - substep);
+        t_speed_arrays *cells_ptr = child_cells;
+        child_cells = child_tmp_cells;
+        child_tmp_cells = cells_ptr;
+        *vels_at(&vels, tt) = av_velocity(child_params, child_cells, child_obstacles, 2);
       }
+      compute_time += MPI_Wtime() - compute_tic;
+    } else {
+      compute_tic = MPI_Wtime();
+      accelerate_flow(child_params, child_cells, child_obstacles, 2);
+      double wait_time = timestep_overlapped(&decomp, child_params, child_cells, child_tmp_cells, child_obstacles);
+      t_speed_arrays *cells_ptr = child_cells;
+      child_cells = child_tmp_cells;
+      child_tmp_cells = cells_ptr;
+      *vels_at(&vels, tt) = av_velocity(child_params, child_cells, child_obstacles, 2);
+      compute_time += MPI_Wtime() - compute_tic - wait_time;
     }
 
 #ifdef DEBUG
     printf("==timestep: %d==\n", tt);
-    printf("av velocity: %.12E\n", av_vels[tt]);
-    printf("tot density: %.12E\n", total_density(params, cells));
+    printf("av velocity: %.12E\n", *vels_at(&vels, tt));
+    printf("tot density: %.12E\n", total_density(child_params, child_cells));
 #endif
     if(TEST && rank == 0 && (tt < 20 || tt % 500 == 0)) {
       printf("==timestep: %d==\n", tt);
-      printf("av velocity: %.12E\n", child_vels[tt]);
-    }
-  }
-
-  //Handle average velocity computations
-  if(rank == 0) {
-    for(int process = 1; process < size; ++process) {
-      MPI_Recv(rbuffer_vels, child_params.maxIters, MPI_FLOAT, process, 2, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-      for(int tt = 0; tt < child_params.maxIters; ++tt) {
-        child_vels[tt] += rbuffer_vels[tt];
-      }
-    }
-    //compute average velocity
-    int tot_u = 0;
-    for(int row = 0; row < params.ny; ++row) {
-      for(int col = 0; col < params.nx; ++col) {
-        if(!obstacles[row*params.nx + col]) {
-          ++tot_u;
-        }
-      }
+      printf("av velocity: %.12E\n", *vels_at(&vels, tt));
     }
-    for(int tt = 0; tt < child_params.maxIters; ++tt) {
-      av_vels[tt] = child_vels[tt] / tot_u;
+    if(CHECKPOINT_EVERY > 0 && (tt + 1) % CHECKPOINT_EVERY == 0 && tt + 1 < params.maxIters) {
+      t_speed_arrays* dense_cells = child_cells;
+      if(SPARSE_LATTICE) dense_cells = sparse_to_dense(child_params, &sparse);
+      if(HALF_STORAGE) dense_cells = half_to_dense(child_params, child_cells);
+      //the velocities so far go in rank 0's checkpoint, so they must have landed
+      vels_flush(&vels, tt + 1, 1);
+      checkpoint_start(&checkpoint, &decomp, params, child_params, dense_cells, av_vels, tt + 1);
+      if(dense_cells != child_cells) free_t_speed_arrays(dense_cells);
     }
-  } else {
-    MPI_Send(child_vels, child_params.maxIters, MPI_FLOAT, 0, 2, MPI_COMM_WORLD);
+    checkpoint_finish(&checkpoint, 0);
   }
+  checkpoint_finish(&checkpoint, 1);
+
+  //the last batch of velocities
+  vels_flush(&vels, params.maxIters, 1);
+  free(vels.sums[0]);
+  free(vels.sums[1]);
 
   if(rank == 0) {
     //char output_file[1024];
@@ -455,62 +828,52 @@ int main(int argc, char* argv[])
     printf("Elapsed user CPU time:\t\t%.6lf (s)\n", usrtim);
     printf("Elapsed system CPU time:\t%.6lf (s)\n", systim);
   }
+  if(REPORT_IMBALANCE) {
+    report_imbalance(&decomp, child_params, child_obstacles, compute_time);
+  }
 
 //DONT TIME THIS!!!! {{{
-  //Send data from child process to master
-  float *send_child_buffer_cells = (float*) malloc(child_params.nx * child_params.ny * NSPEEDS * sizeof(float));
-  int *send_child_buffer_obstacles = (int*) malloc(child_params.nx * child_params.ny * sizeof(int));
-  for(int col = 1; col < child_params.nx-1; ++col) {
-    for(int row = 0; row < child_params.ny; ++row) {
-      send_child_buffer_obstacles[col*child_params.ny + row] = child_obstacles[row*child_params.nx + col];
-      for(int speed = 0; speed < NSPEEDS; ++speed) {
-        send_child_buffer_cells[col*child_params.ny*NSPEEDS + row*NSPEEDS + speed] = child_cells->speeds[speed][row*child_params.nx + col];
-      }
-    }
-    MPI_Request send_request;
-    MPI_Isend(&send_child_buffer_cells[col*child_params.ny*NSPEEDS], child_params.ny*NSPEEDS, MPI_FLOAT, 0, 0, MPI_COMM_WORLD, &send_request);
-    MPI_Isend(&send_child_buffer_obstacles[col*child_params.ny], child_params.ny, MPI_INT, 0, 1, MPI_COMM_WORLD, &send_request);
+  if(SPARSE_LATTICE) {
+    child_cells = sparse_to_dense(child_params, &sparse);
+    sparse_free(&sparse);
   }
-
-  if(rank == 0) {
-    //Receive data from children
-    for(int process = 0; process < size; ++process) {
-      int current_child_cols = calc_ncols_from_rank(process, size, params.nx);
-      int start_from = start_process_grid_from(size, process, params.nx);
-      for(int col = start_from, child_col = 0; col < start_from + current_child_cols; ++col, ++child_col) {
-        MPI_Recv(rbuffer_cells1, child_params.ny*NSPEEDS, MPI_FLOAT, process, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-        MPI_Recv(rbuffer_obstacles1, child_params.ny, MPI_INT, process, 1, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-        //Fill send buffers
-        for(int row = 0; row < params.ny; ++row) {
-          obstacles[row*params.nx + col] = rbuffer_obstacles1[row];
-          //t_speed speeds;
-          for(int speed = 0; speed < NSPEEDS; ++speed) {
-            //speeds.speeds[speed] = rbuffer_cells1[row*NSPEEDS + speed];
-            cells->speeds[speed][row*params.nx + col] = rbuffer_cells1[row*NSPEEDS + speed];
-          }
-        }
-      }
-    }
+  if(HALF_STORAGE) {
+    t_speed_arrays* dense_cells = half_to_dense(child_params, child_cells);
+    free_t_speed_arrays(child_cells);
+    child_cells = dense_cells;
+  }
+  if(AA_PATTERN && params.maxIters % 2 == 1) {
+    //finished on an even step, so the lattice is not in the natural layout
+    t_speed_arrays *natural_cells = create_t_speed_arrays(child_params);
+    aa_to_natural(child_params, child_cells, natural_cells);
+    free_t_speed_arrays(child_cells);
+    child_cells = natural_cells;
   }
 
   //}}}
 
-  if(rank == 0) {
-    write_values(params, cells, obstacles, av_vels);
-    finalise(&params, &cells, &tmp_cells, &obstacles, &av_vels);
+  double output_tic = MPI_Wtime();
+  write_values(&decomp, params, child_params, child_cells, child_obstacles, av_vels);
+  if(rank == 0) printf("Elapsed output time:\t\t%.6lf (s)\n", MPI_Wtime() - output_tic);
+  if(half_check_dir && rank == 0) half_check(params, av_vels, half_check_dir);
+  free(av_vels);
+
+  free_halo_types();
+  if(SHARED_HALOS) {
+    //the windows can't outlive MPI
+    free_t_speed_arrays(child_cells);
+    free_t_speed_arrays(child_tmp_cells);
+    child_cells = child_tmp_cells = NULL;
+    MPI_Comm_free(&decomp.node);
   }
 
   /* finialise the MPI enviroment */
   MPI_Finalize();
-  free(child_cells);
-  free(child_tmp_cells);
+  free_t_speed_arrays(child_cells);
+  free_t_speed_arrays(child_tmp_cells);
   free(child_obstacles);
-  free(sbuffer_cells1);
-  free(rbuffer_cells1);
-  free(sbuffer_obstacles1);
-  free(rbuffer_obstacles1);
-  free(sbuffer_cells2);
-  free(rbuffer_cells2);
+  free(decomp.col_splits);
+  free(decomp.row_splits);
 
   return EXIT_SUCCESS;
 }
@@ -551,205 +914,2293 @@ int min(int a, int b) {
   return (a < b) ? a : b;
 }
 
-void exchange_obstacles(int rank, int size, t_param child_params, int *child_obstacles,
-                      int* sbuffer_obstacles, int* rbuffer_obstacles) {
-  int left = (rank == 0) ? (rank + size - 1) : (rank - 1); // left is bottom, right is top equiv
-  int right = (rank + 1) % size;
+int max(int a, int b) {
+  return (a > b) ? a : b;
+}
+
+/* fill the obstacle halos with the neighbours' boundary cells, cols first so the rows carry the corners */
+void exchange_obstacles(const t_decomp* decomp, t_param child_params, unsigned char *child_obstacles) {
+  int nx = child_params.nx;
+  int ny = child_params.ny;
+  int pitch = child_params.pitch;
+  int cols = child_params.halo_cols;
+  int rows = child_params.halo_rows;
+  MPI_Datatype halo_cols, halo_rows;
+  MPI_Type_vector(ny, cols, pitch, MPI_UNSIGNED_CHAR, &halo_cols);
+  MPI_Type_commit(&halo_cols);
+  MPI_Type_vector(rows, nx, pitch, MPI_UNSIGNED_CHAR, &halo_rows);
+  MPI_Type_commit(&halo_rows);
   //send to the left, receive from right
-  //fill with left col
-  for(int row = 0; row < child_params.ny; ++row) {
-    sbuffer_obstacles[row] = child_obstacles[row*child_params.nx + 1];
-  }
-  MPI_Sendrecv(sbuffer_obstacles, child_params.ny, MPI_INT, left, 1, rbuffer_obstacles,
-              child_params.ny, MPI_INT, right, 1, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-  //populate right col
-  for(int row = 0; row < child_params.ny; ++row) {
-    child_obstacles[row*child_params.nx + (child_params.nx - 1)] = rbuffer_obstacles[row];
-  }
+  MPI_Sendrecv(&child_obstacles[cols], 1, halo_cols, decomp->left, 1,
+               &child_obstacles[nx - cols], 1, halo_cols, decomp->right, 1, decomp->comm, MPI_STATUS_IGNORE);
   //send to right, receive from left
-  //fill with right col
-  for(int row = 0; row < child_params.ny; ++row) {
-    sbuffer_obstacles[row] = child_obstacles[row*child_params.nx + (child_params.nx - 2)];
-  }
-  MPI_Sendrecv(sbuffer_obstacles, child_params.ny, MPI_INT, right, 1, rbuffer_obstacles,
-              child_params.ny, MPI_INT, left, 1, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-  //populate left col
-  for(int row = 0; row < child_params.ny; ++row) {
-    child_obstacles[row*child_params.nx] = rbuffer_obstacles[row];
-  }
+  MPI_Sendrecv(&child_obstacles[nx - 2*cols], 1, halo_cols, decomp->right, 1,
+               child_obstacles, 1, halo_cols, decomp->left, 1, decomp->comm, MPI_STATUS_IGNORE);
+  MPI_Type_free(&halo_cols);
+  //send to the bottom, receive from top
+  MPI_Sendrecv(&child_obstacles[rows*pitch], 1, halo_rows, decomp->down, 1,
+               &child_obstacles[(ny - rows)*pitch], 1, halo_rows, decomp->up, 1,
+               decomp->comm, MPI_STATUS_IGNORE);
+  //send to the top, receive from bottom
+  MPI_Sendrecv(&child_obstacles[(ny - 2*rows)*pitch], 1, halo_rows, decomp->up, 1,
+               child_obstacles, 1, halo_rows, decomp->down, 1,
+               decomp->comm, MPI_STATUS_IGNORE);
+  MPI_Type_free(&halo_rows);
 }
 
 
-void exchange_halos_async(MPI_Request** requests, int rank, int size, t_param child_params, t_speed_arrays *child_cells,
-                      float* sbuffer_cells1, float* rbuffer_cells1,
-                      float* sbuffer_cells2, float* rbuffer_cells2) {
-  int left = (rank == 0) ? (rank + size - 1) : (rank - 1); // left is bottom, right is top equiv
-  int right = (rank + 1) % size;
-  int speeds_to_send = REDUCE_HALO_SPEED_ECHANGE ? 3 : NSPEEDS;
-  MPI_Irecv(rbuffer_cells1, child_params.ny*speeds_to_send, MPI_FLOAT, right, 0, MPI_COMM_WORLD, requests[1]);
-  MPI_Irecv(rbuffer_cells2, child_params.ny*speeds_to_send, MPI_FLOAT, left, 0, MPI_COMM_WORLD, requests[3]);
-  //send to the left, receive from right
-  //fill with left col
-  for(int row = 0; row < child_params.ny; ++row) {
-    if(REDUCE_HALO_SPEED_ECHANGE) {
-        sbuffer_cells1[row*speeds_to_send + 0] = child_cells->speeds[3][row*child_params.nx + 1];
-        sbuffer_cells1[row*speeds_to_send + 1] = child_cells->speeds[6][row*child_params.nx + 1];
-        sbuffer_cells1[row*speeds_to_send + 2] = child_cells->speeds[7][row*child_params.nx + 1];
-    } else {
-      for(int speed = 0; speed < NSPEEDS; ++speed) {
-        sbuffer_cells1[row*speeds_to_send + speed] = child_cells->speeds[speed][row*child_params.nx + 1];
-      }
+t_speed_arrays* create_t_speed_arrays(t_param params) {
+  t_speed_arrays* object_ptr = alloc_speed_arena(params.pitch*params.ny);
+  //first touch with the same row split as the kernels, so pages land on the NUMA node of the thread using them
+  #pragma omp parallel for schedule(static)
+  for(int jj = 0; jj < params.ny; ++jj) {
+    for(int kk = 0; kk < NSPEEDS; ++kk) {
+      memset(&object_ptr->speeds[kk][jj*params.pitch], 0, params.pitch*sizeof(float));
     }
-
   }
-  MPI_Isend(sbuffer_cells1, child_params.ny*speeds_to_send, MPI_FLOAT, left, 0, MPI_COMM_WORLD, requests[0]);
+  return object_ptr;
+}
 
-  //send to right, receive from left
-  //fill with right col
-  for(int row = 0; row < child_params.ny; ++row) {
-    if(REDUCE_HALO_SPEED_ECHANGE) {
-      sbuffer_cells2[row*speeds_to_send + 0] = child_cells->speeds[1][row*child_params.nx + (child_params.nx - 2)];
-      sbuffer_cells2[row*speeds_to_send + 1] = child_cells->speeds[5][row*child_params.nx + (child_params.nx - 2)];
-      sbuffer_cells2[row*speeds_to_send + 2] = child_cells->speeds[8][row*child_params.nx + (child_params.nx - 2)];
-    } else {
-      for(int speed = 0; speed < NSPEEDS; ++speed) {
-        sbuffer_cells2[row*speeds_to_send + speed] = child_cells->speeds[speed][row*child_params.nx + (child_params.nx - 2)];
-      }
+/*
+** Cells from one row start to the next for rows of nx cells, with padding
+** floats after each. A negative padding picks it: rows start on a cache line,
+** and never a multiple of 4 KB apart, where the loads from the rows above and
+** below the one being stored alias it and each other in the L1.
+*/
+int row_pitch(int nx, int padding) {
+  if(padding >= 0) return nx + padding;
+  int pitch = (nx + 15) & ~15;
+  if(pitch % 1024 == 0) pitch += 16;
+  return pitch;
+}
+
+/*
+** Lay the NSPEEDS arrays of ncells floats out in one allocation, each 64 byte
+** aligned and SPEED_PADDING floats after the previous one. Without the padding
+** power-of-two lattices put the same cell of every speed on the same cache set
+** and 4K offset, so the nine streams of the kernels evict each other. With
+** HUGE_PAGES the arena is 2 MB aligned and either advised to transparent huge
+** pages or mapped from the explicit huge page pool, falling back to the
+** former when the pool is empty. The arrays are not touched.
+*/
+t_speed_arrays* alloc_speed_arena(int ncells) {
+  const size_t align = 64;
+  const size_t huge_page = 2 << 20;
+  t_speed_arrays* obj = (t_speed_arrays*) calloc(1, sizeof(t_speed_arrays));
+  if(obj == NULL) die("cannot allocate memory for the lattice", __LINE__, __FILE__);
+
+  size_t stride = speed_stride(ncells);
+  obj->arena_len = NSPEEDS * stride;
+  if(HUGE_PAGES) obj->arena_len = ((obj->arena_len + huge_page - 1) / huge_page) * huge_page;
+#ifdef MAP_HUGETLB
+  if(HUGE_PAGES == 2) {
+    obj->arena = mmap(NULL, obj->arena_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if(obj->arena == MAP_FAILED) obj->arena = NULL;
+    obj->arena_mapped = (obj->arena != NULL);
+  }
+#endif
+  if(obj->arena == NULL) {
+    if(posix_memalign(&obj->arena, HUGE_PAGES ? huge_page : align, obj->arena_len) != 0) {
+      die("cannot allocate memory for the lattice", __LINE__, __FILE__);
     }
+#ifdef MADV_HUGEPAGE
+    if(HUGE_PAGES) madvise(obj->arena, obj->arena_len, MADV_HUGEPAGE);
+#endif
+  }
+  for(int kk = 0; kk < NSPEEDS; ++kk) {
+    obj->speeds[kk] = (float*) ((char*) obj->arena + kk*stride);
   }
-  MPI_Isend(sbuffer_cells2, child_params.ny*speeds_to_send, MPI_FLOAT, right, 0, MPI_COMM_WORLD, requests[2]);
+  return obj;
+}
 
+/* bytes from one speed array of an arena to the next, see alloc_speed_arena() */
+size_t speed_stride(int ncells) {
+  const size_t align = 64;
+  return ((ncells*sizeof(float) + align - 1) / align) * align + SPEED_PADDING*sizeof(float);
 }
 
-t_speed_arrays* create_t_speed_arrays(t_param params) {
-  t_speed_arrays* object_ptr = (t_speed_arrays*) calloc(1, sizeof(t_speed_arrays));
+/*
+** A lattice laid out like alloc_speed_arena() but in an MPI-3 shared window
+** of decomp->node, so the same-node neighbours can read its halos in place.
+** Collective over the node. The window stays in a passive epoch for the
+** MPI_Win_sync calls of shared_fence(). The arenas of the neighbours are
+** looked up once, 64 byte aligned the same way as this one: the segments are
+** mapped page aligned in every process.
+*/
+t_speed_arrays* create_shared_speed_arrays(t_param params, const t_decomp* decomp) {
+  const size_t align = 64;
+  t_speed_arrays* obj = (t_speed_arrays*) calloc(1, sizeof(t_speed_arrays));
+  if(obj == NULL) die("cannot allocate memory for the lattice", __LINE__, __FILE__);
+
+  size_t stride = speed_stride(params.pitch*params.ny);
+  obj->arena_len = NSPEEDS * stride + align;
+  MPI_Info info;
+  MPI_Info_create(&info);
+  //each process' segment on its own pages, first touched by itself
+  MPI_Info_set(info, "alloc_shared_noncontig", "true");
+  if(MPI_Win_allocate_shared(obj->arena_len, 1, info, decomp->node, &obj->arena, &obj->win) != MPI_SUCCESS) {
+    die("cannot allocate the shared lattice window", __LINE__, __FILE__);
+  }
+  MPI_Info_free(&info);
+  MPI_Win_lock_all(MPI_MODE_NOCHECK, obj->win);
+  obj->arena_shared = 1;
+
+  char* base = (char*) obj->arena + (align - (uintptr_t) obj->arena % align) % align;
   for(int kk = 0; kk < NSPEEDS; ++kk) {
-    object_ptr->speeds[kk] = (float*) calloc(params.nx*params.ny, sizeof(float));
+    obj->speeds[kk] = (float*) (base + kk*stride);
   }
-  return object_ptr;
+  for(int dir = 0; dir < 4; ++dir) {
+    if(decomp->node_peers[dir] < 0) continue;
+    MPI_Aint len;
+    int disp_unit;
+    char* peer;
+    MPI_Win_shared_query(obj->win, decomp->node_peers[dir], &len, &disp_unit, &peer);
+    obj->peer_arenas[dir] = peer + (align - (uintptr_t) peer % align) % align;
+  }
+
+  #pragma omp parallel for schedule(static)
+  for(int jj = 0; jj < params.ny; ++jj) {
+    for(int kk = 0; kk < NSPEEDS; ++kk) {
+      memset(&obj->speeds[kk][jj*params.pitch], 0, params.pitch*sizeof(float));
+    }
+  }
+  return obj;
 }
 
 void free_t_speed_arrays(t_speed_arrays* obj) {
-  for(int kk = 0; kk < NSPEEDS; ++kk) {
-    free(obj->speeds[kk]);
+  if(obj == NULL) return;
+  if(obj->arena_shared) {
+    MPI_Win_unlock_all(obj->win);
+    MPI_Win_free(&obj->win);
+  } else if(obj->arena_mapped) {
+    munmap(obj->arena, obj->arena_len);
+  } else {
+    free(obj->arena);
   }
   free(obj);
 }
 
-void exchange_halos(int rank, int size, t_param child_params, t_speed_arrays *child_cells,
-                      float* sbuffer_cells, float* rbuffer_cells) {
-  int left = (rank == 0) ? (rank + size - 1) : (rank - 1); // left is bottom, right is top equiv
-  int right = (rank + 1) % size;
-  //send to the left, receive from right
-  //fill with left col
-  for(int row = 0; row < child_params.ny; ++row) {
-    for(int speed = 0; speed < NSPEEDS; ++speed) {
-      sbuffer_cells[row*NSPEEDS + speed] = child_cells->speeds[speed][row*child_params.nx + 1];
+/*
+** Datatype for width halo cols from col (col >= 0), or width rows from row, of
+** the given speeds, at absolute addresses inside cells so it is used with
+** MPI_BOTTOM. MPI reads and writes the speed arrays directly, with no pack or
+** unpack loops.
+*/
+MPI_Datatype halo_type(t_param child_params, t_speed_arrays* cells, const int* speeds, int nspeeds,
+                       int col, int row, int width)
+{
+  MPI_Datatype line, halo;
+  int blocklengths[NSPEEDS];
+  MPI_Aint displacements[NSPEEDS];
+  MPI_Datatype types[NSPEEDS];
+
+  //16 bit lattices are exchanged as they are stored
+  MPI_Datatype value = cells->half[0] ? MPI_UINT16_T : MPI_FLOAT;
+  if(col >= 0) {
+    MPI_Type_vector(child_params.ny, width, child_params.pitch, value, &line);
+  } else {
+    MPI_Type_vector(width, child_params.nx, child_params.pitch, value, &line);
+  }
+  int start = (col >= 0) ? col : row*child_params.pitch;
+  for(int ii = 0; ii < nspeeds; ++ii) {
+    blocklengths[ii] = 1;
+    if(cells->half[0]) {
+      MPI_Get_address(&cells->half[speeds[ii]][start], &displacements[ii]);
+    } else {
+      MPI_Get_address(&cells->speeds[speeds[ii]][start], &displacements[ii]);
     }
+    types[ii] = line;
   }
+  MPI_Type_create_struct(nspeeds, blocklengths, displacements, types, &halo);
+  MPI_Type_commit(&halo);
+  MPI_Type_free(&line);
 
-  MPI_Sendrecv(sbuffer_cells, child_params.ny*NSPEEDS, MPI_FLOAT, left, 0, rbuffer_cells,
-              child_params.ny*NSPEEDS, MPI_FLOAT, right, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-  //populate right col
-  for(int row = 0; row < child_params.ny; ++row) {
-    //t_speed speeds;
-    for(int speed = 0; speed < NSPEEDS; ++speed) {
-      child_cells->speeds[speed][row*child_params.nx + (child_params.nx - 1)] = rbuffer_cells[row*NSPEEDS + speed];
-      //speeds.speeds[speed] = rbuffer_cells[row*NSPEEDS + speed];
-    }
+  return halo;
+}
+
+/*
+** halo_type() for a lattice of the given shape that is not this process',
+** in a window over its arena: displacements are in bytes from the start of
+** its first speed array, laid out by alloc_speed_arena().
+*/
+MPI_Datatype window_halo_type(int nx, int ny, int pitch, const int* speeds, int nspeeds, int col, int row, int width)
+{
+  MPI_Datatype line, halo;
+  int blocklengths[NSPEEDS];
+  MPI_Aint displacements[NSPEEDS];
+  MPI_Datatype types[NSPEEDS];
 
+  if(col >= 0) {
+    MPI_Type_vector(ny, width, pitch, MPI_FLOAT, &line);
+  } else {
+    MPI_Type_vector(width, nx, pitch, MPI_FLOAT, &line);
   }
-  //send to right, receive from left
-  //fill with right col
-  for(int row = 0; row < child_params.ny; ++row) {
-    for(int speed = 0; speed < NSPEEDS; ++speed) {
-      sbuffer_cells[row*NSPEEDS + speed] = child_cells->speeds[speed][row*child_params.nx + (child_params.nx - 2)];
-    }
+  int start = (col >= 0) ? col : row*pitch;
+  for(int ii = 0; ii < nspeeds; ++ii) {
+    blocklengths[ii] = 1;
+    displacements[ii] = speeds[ii]*speed_stride(pitch*ny) + start*sizeof(float);
+    types[ii] = line;
   }
-  MPI_Sendrecv(sbuffer_cells, child_params.ny*NSPEEDS, MPI_FLOAT, right, 0, rbuffer_cells,
-              child_params.ny*NSPEEDS, MPI_FLOAT, left, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-  //populate left col
-  for(int row = 0; row < child_params.ny; ++row) {
-    //t_speed speeds;
-    for(int speed = 0; speed < NSPEEDS; ++speed) {
-      //speeds.speeds[speed] = rbuffer_cells[row*NSPEEDS + speed];
-      child_cells->speeds[speed][row*child_params.nx] = rbuffer_cells[row*NSPEEDS + speed];
-    }
+  MPI_Type_create_struct(nspeeds, blocklengths, displacements, types, &halo);
+  MPI_Type_commit(&halo);
+  MPI_Type_free(&line);
+
+  return halo;
+}
 
+/* datatype for the given speeds of len cells from (col, row), stride apart, see halo_type() */
+MPI_Datatype edge_halo_type(t_param child_params, t_speed_arrays* cells, const int* speeds, int nspeeds,
+                            int col, int row, int len, int stride)
+{
+  MPI_Datatype line, halo;
+  int blocklengths[NSPEEDS];
+  MPI_Aint displacements[NSPEEDS];
+  MPI_Datatype types[NSPEEDS];
+
+  MPI_Type_vector(len, 1, stride, cells->half[0] ? MPI_UINT16_T : MPI_FLOAT, &line);
+  for(int ii = 0; ii < nspeeds; ++ii) {
+    blocklengths[ii] = 1;
+    if(cells->half[0]) {
+      MPI_Get_address(&cells->half[speeds[ii]][col + row*child_params.pitch], &displacements[ii]);
+    } else {
+      MPI_Get_address(&cells->speeds[speeds[ii]][col + row*child_params.pitch], &displacements[ii]);
+    }
+    types[ii] = line;
   }
+  MPI_Type_create_struct(nspeeds, blocklengths, displacements, types, &halo);
+  MPI_Type_commit(&halo);
+  MPI_Type_free(&line);
+
+  return halo;
 }
 
-void output_state(const char* output_file, int step, t_speed_arrays *cells, int *obstacles, int nx, int ny) {
-  FILE* fp = fopen(output_file, "a");
-  if (fp == NULL)
-  {
-    printf("could not open input parameter file: %s", output_file);
-    return;
+/*
+** The halo datatypes of a lattice, built on first use. The pull exchange only
+** needs the speeds streaming into the block (1/5/8 from the left, 3/6/7 from
+** the right, 2/5/6 from below and 4/7/8 from above) with
+** REDUCE_HALO_SPEED_ECHANGE and single halos, all nine otherwise. Deep halos
+** are HALO_DEPTH cells wide and only have the pull exchange. The AA push
+** exchange returns the same speeds from the halos to the cells they were
+** pushed towards.
+*/
+const t_halo_types* halo_types(t_param child_params, t_speed_arrays* cells)
+{
+  static const int all_speeds[NSPEEDS] = {0, 1, 2, 3, 4, 5, 6, 7, 8};
+  static const int to_left[3] = {3, 6, 7};
+  static const int to_right[3] = {1, 5, 8};
+  static const int to_down[3] = {4, 7, 8};
+  static const int to_up[3] = {2, 5, 6};
+  static const int up_right[1] = {5};
+  static const int up_left[1] = {6};
+  static const int down_right[1] = {8};
+  static const int down_left[1] = {7};
+
+  for(int ii = 0; ii < halo_type_cache_len; ++ii) {
+    if(halo_type_cache[ii].cells == cells) return &halo_type_cache[ii];
   }
-  fprintf(fp, "Step %d:\n", step);
-  for(int i = 0; i < ny; ++i) {
-    for(int j = 0; j < nx; ++j) {
-      for(int z = 0; z < 9; ++z) {
-        fprintf(fp, "%f ", cells->speeds[z][i*nx + j]);
-      }
-      fprintf(fp, "\n");
+  if(halo_type_cache_len == 2) die("halo datatypes exist for two lattices already", __LINE__, __FILE__);
+
+  t_halo_types* halo = &halo_type_cache[halo_type_cache_len++];
+  int nx = child_params.nx;
+  int ny = child_params.ny;
+  //deep halos recompute whole cells, so they need every speed
+  int reduce = REDUCE_HALO_SPEED_ECHANGE && child_params.halo_cols == 1;
+  int n = reduce ? 3 : NSPEEDS;
+  int k = child_params.halo_cols;
+  int r = child_params.halo_rows;
+  halo->cells = cells;
+
+  //first owned cols/rows out, opposite halos in
+  halo->pull[0].send = halo_type(child_params, cells, reduce ? to_left : all_speeds, n, k, 0, k);
+  halo->pull[0].recv = halo_type(child_params, cells, reduce ? to_left : all_speeds, n, nx - k, 0, k);
+  halo->pull[1].send = halo_type(child_params, cells, reduce ? to_right : all_speeds, n, nx - 2*k, 0, k);
+  halo->pull[1].recv = halo_type(child_params, cells, reduce ? to_right : all_speeds, n, 0, 0, k);
+  halo->pull[2].send = halo_type(child_params, cells, reduce ? to_down : all_speeds, n, -1, r, r);
+  halo->pull[2].recv = halo_type(child_params, cells, reduce ? to_down : all_speeds, n, -1, ny - r, r);
+  halo->pull[3].send = halo_type(child_params, cells, reduce ? to_up : all_speeds, n, -1, ny - 2*r, r);
+  halo->pull[3].recv = halo_type(child_params, cells, reduce ? to_up : all_speeds, n, -1, 0, r);
+
+  //the AA, push, edge and corner exchanges only exist for single halos
+  if(k > 1) {
+    for(int dir = 0; dir < 4; ++dir) {
+      halo->aa_push[dir].send = halo->aa_push[dir].recv = MPI_DATATYPE_NULL;
+      halo->push[dir].send = halo->push[dir].recv = MPI_DATATYPE_NULL;
+      halo->edges[dir].send = halo->edges[dir].recv = MPI_DATATYPE_NULL;
+      halo->corners[dir].send = halo->corners[dir].recv = MPI_DATATYPE_NULL;
     }
-    fprintf(fp, "\n");
+    halo->push_cols[0] = halo->push_cols[1] = NULL;
+  } else {
+    //halo out, opposite last owned col/row in
+    halo->aa_push[0].send = halo_type(child_params, cells, to_right, 3, 0, 0, 1);
+    halo->aa_push[0].recv = halo_type(child_params, cells, to_right, 3, nx - 2, 0, 1);
+    halo->aa_push[1].send = halo_type(child_params, cells, to_left, 3, nx - 1, 0, 1);
+    halo->aa_push[1].recv = halo_type(child_params, cells, to_left, 3, 1, 0, 1);
+    halo->aa_push[2].send = halo_type(child_params, cells, to_up, 3, -1, 0, 1);
+    halo->aa_push[2].recv = halo_type(child_params, cells, to_up, 3, -1, ny - 2, 1);
+    halo->aa_push[3].send = halo_type(child_params, cells, to_down, 3, -1, ny - 1, 1);
+    halo->aa_push[3].recv = halo_type(child_params, cells, to_down, 3, -1, 1, 1);
+
+    //push step out of the halos into the last owned col/row. The push step writes
+    //the halo cols straight into contiguous buffers, the rows are contiguous anyway
+    for(int side = 0; side < 2; ++side) {
+      int len = 3*ny;
+      MPI_Aint address;
+      MPI_Datatype type = MPI_FLOAT;
+      halo->push_cols[side] = (float*) calloc(len, sizeof(float));
+      if(halo->push_cols[side] == NULL) die("cannot allocate memory for the push buffers", __LINE__, __FILE__);
+      MPI_Get_address(halo->push_cols[side], &address);
+      MPI_Type_create_struct(1, &len, &address, &type, &halo->push[side].send);
+      MPI_Type_commit(&halo->push[side].send);
+    }
+    halo->push[0].recv = halo_type(child_params, cells, to_left, 3, nx - 2, 0, 1);
+    halo->push[1].recv = halo_type(child_params, cells, to_right, 3, 1, 0, 1);
+    halo->push[2].send = halo_type(child_params, cells, to_down, 3, -1, 0, 1);
+    halo->push[2].recv = halo_type(child_params, cells, to_down, 3, -1, ny - 2, 1);
+    halo->push[3].send = halo_type(child_params, cells, to_up, 3, -1, ny - 1, 1);
+    halo->push[3].recv = halo_type(child_params, cells, to_up, 3, -1, 1, 1);
+
+    //the pull exchange without the corner halos, which come from the diagonal neighbours instead
+    int hr = child_params.halo_rows;
+    int rows = ny - 2*hr;
+    halo->edges[0].send = edge_halo_type(child_params, cells, reduce ? to_left : all_speeds, n, 1, hr, rows, child_params.pitch);
+    halo->edges[0].recv = edge_halo_type(child_params, cells, reduce ? to_left : all_speeds, n, nx - 1, hr, rows, child_params.pitch);
+    halo->edges[1].send = edge_halo_type(child_params, cells, reduce ? to_right : all_speeds, n, nx - 2, hr, rows, child_params.pitch);
+    halo->edges[1].recv = edge_halo_type(child_params, cells, reduce ? to_right : all_speeds, n, 0, hr, rows, child_params.pitch);
+    halo->edges[2].send = edge_halo_type(child_params, cells, reduce ? to_down : all_speeds, n, 1, 1, nx - 2, 1);
+    halo->edges[2].recv = edge_halo_type(child_params, cells, reduce ? to_down : all_speeds, n, 1, ny - 1, nx - 2, 1);
+    halo->edges[3].send = edge_halo_type(child_params, cells, reduce ? to_up : all_speeds, n, 1, ny - 2, nx - 2, 1);
+    halo->edges[3].recv = edge_halo_type(child_params, cells, reduce ? to_up : all_speeds, n, 1, 0, nx - 2, 1);
+
+    //the one speed that streams diagonally into each corner halo, when reduced
+    int nc = reduce ? 1 : NSPEEDS;
+    halo->corners[0].send = edge_halo_type(child_params, cells, reduce ? up_right : all_speeds, nc, nx - 2, ny - 2, 1, 1);
+    halo->corners[0].recv = edge_halo_type(child_params, cells, reduce ? up_right : all_speeds, nc, 0, 0, 1, 1);
+    halo->corners[1].send = edge_halo_type(child_params, cells, reduce ? up_left : all_speeds, nc, 1, ny - 2, 1, 1);
+    halo->corners[1].recv = edge_halo_type(child_params, cells, reduce ? up_left : all_speeds, nc, nx - 1, 0, 1, 1);
+    halo->corners[2].send = edge_halo_type(child_params, cells, reduce ? down_right : all_speeds, nc, nx - 2, 1, 1, 1);
+    halo->corners[2].recv = edge_halo_type(child_params, cells, reduce ? down_right : all_speeds, nc, 0, ny - 1, 1, 1);
+    halo->corners[3].send = edge_halo_type(child_params, cells, reduce ? down_left : all_speeds, nc, 1, 1, 1, 1);
+    halo->corners[3].recv = edge_halo_type(child_params, cells, reduce ? down_left : all_speeds, nc, nx - 1, ny - 1, 1, 1);
   }
-  for(int i = 0; i < ny; ++i) {
-    for(int j = 0; j < nx; ++j) {
-      fprintf(fp, "%d ", obstacles[i*nx + j]);
+  halo->nrequests = 0;
+  halo->rma_ready = 0;
+
+  return halo;
+}
+
+void free_halo_types(void)
+{
+  for(int ii = 0; ii < halo_type_cache_len; ++ii) {
+    for(int req = 0; req < halo_type_cache[ii].nrequests; ++req) {
+      MPI_Request_free(&halo_type_cache[ii].requests[req]);
+    }
+    for(int dir = 0; dir < 4; ++dir) {
+      MPI_Type_free(&halo_type_cache[ii].pull[dir].send);
+      MPI_Type_free(&halo_type_cache[ii].pull[dir].recv);
+      if(halo_type_cache[ii].edges[dir].send == MPI_DATATYPE_NULL) continue;  /* deep halos */
+      MPI_Type_free(&halo_type_cache[ii].aa_push[dir].send);
+      MPI_Type_free(&halo_type_cache[ii].aa_push[dir].recv);
+      MPI_Type_free(&halo_type_cache[ii].edges[dir].send);
+      MPI_Type_free(&halo_type_cache[ii].edges[dir].recv);
+      MPI_Type_free(&halo_type_cache[ii].corners[dir].send);
+      MPI_Type_free(&halo_type_cache[ii].corners[dir].recv);
+      MPI_Type_free(&halo_type_cache[ii].push[dir].send);
+      MPI_Type_free(&halo_type_cache[ii].push[dir].recv);
+    }
+    free(halo_type_cache[ii].push_cols[0]);
+    free(halo_type_cache[ii].push_cols[1]);
+    if(halo_type_cache[ii].rma_ready) {
+      MPI_Win_free(&halo_type_cache[ii].win);
+      for(int dir = 0; dir < 4; ++dir) {
+        MPI_Type_free(&halo_type_cache[ii].put_targets[dir]);
+      }
+      MPI_Group_free(&halo_type_cache[ii].put_groups[0]);
+      MPI_Group_free(&halo_type_cache[ii].put_groups[1]);
     }
-    fprintf(fp, "\n");
   }
-  fprintf(fp, "\n\n");
-  fclose(fp);
+  halo_type_cache_len = 0;
 }
 
-int calc_ncols_from_rank(int rank, int size, int nx)
+/*
+** Exchange pairs of halos to the left, right, down and up. Rows go second, so
+** that the corners travel with the cols first and then on with the rows.
+*/
+void sendrecv_halos(const t_decomp* decomp, const t_halo_pair* pairs)
 {
-  int ncols;
+  MPI_Sendrecv(MPI_BOTTOM, 1, pairs[0].send, decomp->left, 0, MPI_BOTTOM, 1, pairs[0].recv, decomp->right, 0,
+               decomp->comm, MPI_STATUS_IGNORE);
+  MPI_Sendrecv(MPI_BOTTOM, 1, pairs[1].send, decomp->right, 0, MPI_BOTTOM, 1, pairs[1].recv, decomp->left, 0,
+               decomp->comm, MPI_STATUS_IGNORE);
+  MPI_Sendrecv(MPI_BOTTOM, 1, pairs[2].send, decomp->down, 0, MPI_BOTTOM, 1, pairs[2].recv, decomp->up, 0,
+               decomp->comm, MPI_STATUS_IGNORE);
+  MPI_Sendrecv(MPI_BOTTOM, 1, pairs[3].send, decomp->up, 0, MPI_BOTTOM, 1, pairs[3].recv, decomp->down, 0,
+               decomp->comm, MPI_STATUS_IGNORE);
+}
 
-  if(!SPREAD_COLS_EVENLY) {
-    ncols = nx / size;       /* integer division */
-    if ((nx % size) != 0) {  /* if there is a remainder */
-      if (rank == size - 1)
-        ncols += nx % size;  /* add remainder to last rank */
+/*
+** Start filling the halos of cells without waiting, with persistent requests
+** made on first use. All messages are in flight at once, so the corner
+** halos come straight from the diagonal neighbours instead of travelling
+** with the rows, no two receives overlap and every direction has its own tag. Complete with
+** MPI_Waitall on the returned requests.
+*/
+const t_halo_types* start_halos(const t_decomp* decomp, t_param child_params, t_speed_arrays* cells)
+{
+  t_halo_types* halo = (t_halo_types*) halo_types(child_params, cells);
+
+  if(halo->nrequests == 0) {
+    const int to[8] = {decomp->left, decomp->right, decomp->down, decomp->up,
+                       decomp->corners[3], decomp->corners[2], decomp->corners[1], decomp->corners[0]};
+    const int from[8] = {decomp->right, decomp->left, decomp->up, decomp->down,
+                         decomp->corners[0], decomp->corners[1], decomp->corners[2], decomp->corners[3]};
+    const t_halo_pair* pairs[8] = {&halo->edges[0], &halo->edges[1], &halo->edges[2], &halo->edges[3],
+                                   &halo->corners[0], &halo->corners[1], &halo->corners[2], &halo->corners[3]};
+    //receives first, so they are posted before the sends start
+    for(int dir = 0; dir < 8; ++dir) {
+      MPI_Recv_init(MPI_BOTTOM, 1, pairs[dir]->recv, from[dir], dir, decomp->comm, &halo->requests[halo->nrequests++]);
     }
-  } else {
-    int per_process = nx / size;
-    int remainder_cols = nx % size;
-    ncols = per_process;
-    if(rank < remainder_cols) {
-      ++ncols;
+    for(int dir = 0; dir < 8; ++dir) {
+      MPI_Send_init(MPI_BOTTOM, 1, pairs[dir]->send, to[dir], dir, decomp->comm, &halo->requests[halo->nrequests++]);
     }
   }
+  MPI_Startall(halo->nrequests, halo->requests);
 
-  return ncols;
+  return halo;
 }
 
-void initialise_params_from_file(const char* paramfile, t_param* params) {
-  char   message[1024];  /* message buffer */
-  int    retval;         /* to hold return value for checking */
-  FILE* fp;
-
-  /* open the parameter file */
-  fp = fopen(paramfile, "r");
+/* fill the halos with the neighbours' boundary cells */
+void exchange_halos(const t_decomp* decomp, t_param child_params, t_speed_arrays *child_cells) {
+  if(child_cells->arena_shared) {
+    exchange_halos_shared(decomp, child_params, child_cells);
+    return;
+  }
+  if(decomp->rma_halos) {
+    exchange_halos_rma(decomp, child_params, child_cells);
+    return;
+  }
+  sendrecv_halos(decomp, halo_types(child_params, child_cells)->pull);
+}
 
-  if (fp == NULL)
-  {
-    sprintf(message, "could not open input parameter file: %s", paramfile);
-    die(message, __LINE__, __FILE__);
+/*
+** Cross-check of the reduced pull exchange, for cells that exchange_halos()
+** has just filled: exchange all speeds of a copy of cells the same way and
+** compare every halo value that streams into an owned cell. The corners
+** travel with the rows in both, so this also covers the diagonal neighbours
+** of a 2D decomposition. Dies on every process if any value differs.
+*/
+void check_halos(const t_decomp* decomp, t_param child_params, t_speed_arrays* cells)
+{
+  static const int all_speeds[NSPEEDS] = {0, 1, 2, 3, 4, 5, 6, 7, 8};
+  static const int dx[NSPEEDS] = {0, 1, 0, -1, 0, 1, -1, -1, 1};
+  static const int dy[NSPEEDS] = {0, 0, 1, 0, -1, 1, 1, -1, -1};
+  int nx = child_params.nx;
+  int ny = child_params.ny;
+  int k = child_params.halo_cols;
+  int r = child_params.halo_rows;
+
+  t_speed_arrays* full = create_t_speed_arrays(child_params);
+  for(int kk = 0; kk < NSPEEDS; ++kk) {
+    memcpy(full->speeds[kk], cells->speeds[kk], (size_t) child_params.pitch * ny * sizeof(float));
+  }
+  t_halo_pair pull[4];
+  pull[0].send = halo_type(child_params, full, all_speeds, NSPEEDS, k, 0, k);
+  pull[0].recv = halo_type(child_params, full, all_speeds, NSPEEDS, nx - k, 0, k);
+  pull[1].send = halo_type(child_params, full, all_speeds, NSPEEDS, nx - 2*k, 0, k);
+  pull[1].recv = halo_type(child_params, full, all_speeds, NSPEEDS, 0, 0, k);
+  pull[2].send = halo_type(child_params, full, all_speeds, NSPEEDS, -1, r, r);
+  pull[2].recv = halo_type(child_params, full, all_speeds, NSPEEDS, -1, ny - r, r);
+  pull[3].send = halo_type(child_params, full, all_speeds, NSPEEDS, -1, ny - 2*r, r);
+  pull[3].recv = halo_type(child_params, full, all_speeds, NSPEEDS, -1, 0, r);
+  sendrecv_halos(decomp, pull);
+  for(int dir = 0; dir < 4; ++dir) {
+    MPI_Type_free(&pull[dir].send);
+    MPI_Type_free(&pull[dir].recv);
   }
 
-  /* read in the parameter values */
-  retval = fscanf(fp, "%d\n", &(params->nx));
+  int mismatches = 0;
+  for(int jj = 0; jj < ny; ++jj) {
+    for(int ii = 0; ii < nx; ++ii) {
+      if(ii >= k && ii < nx - k && jj >= r && jj < ny - r) continue;
+      for(int kk = 0; kk < NSPEEDS; ++kk) {
+        int to_ii = ii + dx[kk];
+        int to_jj = jj + dy[kk];
+        if(to_ii < k || to_ii >= nx - k || to_jj < r || to_jj >= ny - r) continue;
+        if(cells->speeds[kk][ii + jj*child_params.pitch] != full->speeds[kk][ii + jj*child_params.pitch]) ++mismatches;
+      }
+    }
+  }
+  free_t_speed_arrays(full);
 
-  if (retval != 1) die("could not read param file: nx", __LINE__, __FILE__);
+  int tot_mismatches;
+  MPI_Allreduce(&mismatches, &tot_mismatches, 1, MPI_INT, MPI_SUM, decomp->comm);
+  if(tot_mismatches > 0) die("reduced halo exchange differs from the exchange of all speeds", __LINE__, __FILE__);
+}
 
-  retval = fscanf(fp, "%d\n", &(params->ny));
+/*
+** After an AA even step the halos hold values that the boundary cells pushed
+** towards the neighbouring ranks (speeds 1/5/8 on the left, 3/6/7 on the right,
+** 4/7/8 at the top, 2/5/6 at the bottom). Hand them over to the ranks that own
+** those locations.
+*/
+void exchange_halos_aa_reverse(const t_decomp* decomp, t_param child_params, t_speed_arrays *child_cells) {
+  sendrecv_halos(decomp, halo_types(child_params, child_cells)->aa_push);
+}
 
-  if (retval != 1) die("could not read param file: ny", __LINE__, __FILE__);
+/*
+** After a push step the halos of child_cells hold what its boundary cells
+** streamed out, the cols in push_cols and the rows in place. Hand them over
+** to the last owned col/row of the neighbours they belong to. The cols carry
+** the corner halos on to the rows, as in exchange_halos().
+*/
+void exchange_halos_push(const t_decomp* decomp, t_param child_params, t_speed_arrays *child_cells) {
+  sendrecv_halos(decomp, halo_types(child_params, child_cells)->push);
+}
+
+/*
+** Child nx, ny and pitch of the left, right, down and up neighbours, which
+** locate their boundary cells and halos in their arenas for the halos read
+** or put straight into them.
+*/
+void neighbour_shapes(t_decomp* decomp, t_param child_params)
+{
+  static const int from_dir[4] = {1, 0, 3, 2};
+  const int to[4] = {decomp->left, decomp->right, decomp->down, decomp->up};
+  int shape[3] = {child_params.nx, child_params.ny, child_params.pitch};
+
+  for(int dir = 0; dir < 4; ++dir) {
+    int from = from_dir[dir];
+    int peer_shape[3];
+    MPI_Sendrecv(shape, 3, MPI_INT, to[dir], 0, peer_shape, 3, MPI_INT, to[from], 0,
+                 decomp->comm, MPI_STATUS_IGNORE);
+    decomp->peer_nx[from] = peer_shape[0];
+    decomp->peer_ny[from] = peer_shape[1];
+    decomp->peer_pitch[from] = peer_shape[2];
+  }
+}
+
+/* find the neighbours on this process' node, for SHARED_HALOS */
+void shared_decomp(t_decomp* decomp)
+{
+  MPI_Comm_split_type(decomp->comm, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &decomp->node);
+
+  MPI_Group comm_group, node_group;
+  MPI_Comm_group(decomp->comm, &comm_group);
+  MPI_Comm_group(decomp->node, &node_group);
+  int neighbours[4] = {decomp->left, decomp->right, decomp->down, decomp->up};
+  MPI_Group_translate_ranks(comm_group, 4, neighbours, node_group, decomp->node_peers);
+  for(int dir = 0; dir < 4; ++dir) {
+    if(decomp->node_peers[dir] == MPI_UNDEFINED) decomp->node_peers[dir] = -1;
+  }
+  MPI_Group_free(&comm_group);
+  MPI_Group_free(&node_group);
+}
+
+/*
+** exchange_halos() for lattices in shared windows. Halos from a neighbour on
+** the same node are copied straight out of its lattice by shared_pull(), the
+** others still go through MPI_Sendrecv, with MPI_PROC_NULL for the side that
+** is shared. As in sendrecv_halos() the cols go first and the rows then carry
+** the corners on, and a fence on the node separates the phases: before the
+** cols, until every process has finished writing the cells to be read; before
+** the rows, until every col has been read and landed. Deep halos write the
+** lattice again before the next exchange, so they need a last fence until
+** every row has been read.
+*/
+void exchange_halos_shared(const t_decomp* decomp, t_param child_params, t_speed_arrays *child_cells)
+{
+  static const int from_dir[4] = {1, 0, 3, 2};
+  const t_halo_pair* pull = halo_types(child_params, child_cells)->pull;
+  const int to[4] = {decomp->left, decomp->right, decomp->down, decomp->up};
+
+  for(int phase = 0; phase < 2; ++phase) {
+    shared_fence(decomp, child_cells);
+    for(int dir = 2*phase; dir < 2*phase + 2; ++dir) {
+      int from = from_dir[dir];
+      MPI_Sendrecv(MPI_BOTTOM, 1, pull[dir].send, (decomp->node_peers[dir] < 0) ? to[dir] : MPI_PROC_NULL, 0,
+                   MPI_BOTTOM, 1, pull[dir].recv, (decomp->node_peers[from] < 0) ? to[from] : MPI_PROC_NULL, 0,
+                   decomp->comm, MPI_STATUS_IGNORE);
+      if(decomp->node_peers[from] >= 0) shared_pull(decomp, child_params, child_cells, dir);
+    }
+  }
+  if(child_params.halo_cols > 1) shared_fence(decomp, child_cells);
+}
+
+/*
+** exchange_halos() by one-sided MPI_Put into the neighbours' lattices, with
+** decomp->rma_halos. The window over the lattice and the datatypes of where
+** the halos land in the neighbours' windows are made on first use, by every
+** process at the same exchange. As in sendrecv_halos() the cols go first and
+** the rows then carry the corners on. Each phase is an access and exposure
+** epoch, either between fences or a post/start/complete/wait with the two
+** neighbours of the phase, so no halo is put before its owner has finished
+** the step that reads it, and the corners have landed before the rows go.
+*/
+void exchange_halos_rma(const t_decomp* decomp, t_param child_params, t_speed_arrays *child_cells)
+{
+  t_halo_types* halo = (t_halo_types*) halo_types(child_params, child_cells);
+  const int to[4] = {decomp->left, decomp->right, decomp->down, decomp->up};
+  if(!halo->rma_ready) rma_halo_init(decomp, child_params, halo);
+
+  if(decomp->rma_halos == 1) MPI_Win_fence(MPI_MODE_NOPRECEDE, halo->win);
+  for(int phase = 0; phase < 2; ++phase) {
+    if(decomp->rma_halos == 2) {
+      MPI_Win_post(halo->put_groups[phase], 0, halo->win);
+      MPI_Win_start(halo->put_groups[phase], 0, halo->win);
+    }
+    for(int dir = 2*phase; dir < 2*phase + 2; ++dir) {
+      MPI_Put(MPI_BOTTOM, 1, halo->pull[dir].send, to[dir], 0, 1, halo->put_targets[dir], halo->win);
+    }
+    if(decomp->rma_halos == 1) {
+      MPI_Win_fence((phase == 1) ? MPI_MODE_NOSUCCEED : 0, halo->win);
+    } else {
+      MPI_Win_complete(halo->win);
+      MPI_Win_wait(halo->win);
+    }
+  }
+}
+
+/*
+** The window, target datatypes and PSCW groups of exchange_halos_rma().
+** Collective over decomp->comm. The window covers the speed arrays of the
+** lattice from the first, so a neighbour's halos are found at displacements
+** from its shape alone, see window_halo_type().
+*/
+void rma_halo_init(const t_decomp* decomp, t_param child_params, t_halo_types* halo)
+{
+  static const int all_speeds[NSPEEDS] = {0, 1, 2, 3, 4, 5, 6, 7, 8};
+  static const int pulled[4][3] = {{3, 6, 7}, {1, 5, 8}, {4, 7, 8}, {2, 5, 6}};
+  int reduce = REDUCE_HALO_SPEED_ECHANGE && child_params.halo_cols == 1;
+  int n = reduce ? 3 : NSPEEDS;
+  int k = child_params.halo_cols;
+  int r = child_params.halo_rows;
+
+  //not every one-sided component of an MPI library can serve every job, so
+  //report a failure here rather than abort inside MPI
+  MPI_Comm_set_errhandler(decomp->comm, MPI_ERRORS_RETURN);
+  int err = MPI_Win_create(halo->cells->speeds[0], NSPEEDS*speed_stride(child_params.pitch*child_params.ny), 1,
+                           MPI_INFO_NULL, decomp->comm, &halo->win);
+  MPI_Comm_set_errhandler(decomp->comm, MPI_ERRORS_ARE_FATAL);
+  if(err != MPI_SUCCESS) die("cannot create the halo window, try another one-sided component of the MPI library", __LINE__, __FILE__);
+  //the halo pull[dir] receives, in the lattice of the neighbour it is sent to
+  for(int dir = 0; dir < 4; ++dir) {
+    int col = (dir == 0) ? decomp->peer_nx[dir] - k : (dir == 1) ? 0 : -1;
+    int row = (dir == 2) ? decomp->peer_ny[dir] - r : 0;
+    halo->put_targets[dir] = window_halo_type(decomp->peer_nx[dir], decomp->peer_ny[dir], decomp->peer_pitch[dir],
+                                              reduce ? pulled[dir] : all_speeds, n, col, row, (dir < 2) ? k : r);
+  }
+
+  //a phase puts to and is put to by the same two neighbours, or one if they are the same
+  MPI_Group comm_group;
+  MPI_Comm_group(decomp->comm, &comm_group);
+  const int ranks[2][2] = {{decomp->left, decomp->right}, {decomp->down, decomp->up}};
+  for(int phase = 0; phase < 2; ++phase) {
+    MPI_Group_incl(comm_group, (ranks[phase][0] == ranks[phase][1]) ? 1 : 2, ranks[phase], &halo->put_groups[phase]);
+  }
+  MPI_Group_free(&comm_group);
+  halo->rma_ready = 1;
+}
+
+/* wait for every process on the node, with its stores to cells visible to the others and theirs to this one */
+void shared_fence(const t_decomp* decomp, t_speed_arrays* cells)
+{
+  MPI_Win_sync(cells->win);
+  MPI_Barrier(decomp->node);
+  MPI_Win_sync(cells->win);
+}
+
+/*
+** Copy the halo of pull direction dir (to the left, right, down or up) out
+** of the lattice of the same-node neighbour it comes from: the same speeds
+** and cells the datatypes of halo_types() send and receive.
+*/
+void shared_pull(const t_decomp* decomp, t_param child_params, t_speed_arrays* cells, int dir)
+{
+  static const int all_speeds[NSPEEDS] = {0, 1, 2, 3, 4, 5, 6, 7, 8};
+  static const int pulled[4][3] = {{3, 6, 7}, {1, 5, 8}, {4, 7, 8}, {2, 5, 6}};
+  static const int from_dir[4] = {1, 0, 3, 2};
+  int reduce = REDUCE_HALO_SPEED_ECHANGE && child_params.halo_cols == 1;
+  const int* speeds = reduce ? pulled[dir] : all_speeds;
+  int n = reduce ? 3 : NSPEEDS;
+  int from = from_dir[dir];
+  int nx = child_params.nx;
+  int ny = child_params.ny;
+  int k = child_params.halo_cols;
+  int r = child_params.halo_rows;
+  int peer_nx = decomp->peer_nx[from];
+  int peer_ny = decomp->peer_ny[from];
+  int peer_pitch = decomp->peer_pitch[from];
+
+  //neighbours in a row of processes have as many rows, in a col as many cols
+  int cols, rows, to_col, to_row, from_col, from_row;
+  if(dir < 2) {
+    cols = k;
+    rows = ny;
+    to_col = (dir == 0) ? nx - k : 0;
+    from_col = (dir == 0) ? k : peer_nx - 2*k;
+    to_row = from_row = 0;
+  } else {
+    cols = nx;
+    rows = r;
+    to_row = (dir == 2) ? ny - r : 0;
+    from_row = (dir == 2) ? r : peer_ny - 2*r;
+    to_col = from_col = 0;
+  }
+  size_t stride = speed_stride(peer_pitch*peer_ny);
+  for(int ii = 0; ii < n; ++ii) {
+    const float* src = (const float*) (cells->peer_arenas[from] + speeds[ii]*stride);
+    float* dst = cells->speeds[speeds[ii]];
+    for(int jj = 0; jj < rows; ++jj) {
+      for(int col = 0; col < cols; ++col) {
+        dst[to_col + col + (to_row + jj)*child_params.pitch] = src[from_col + col + (from_row + jj)*peer_pitch];
+      }
+    }
+  }
+}
+
+/*
+** Build the sparse form of the dense lattice cells. Obstacles only matter to
+** the fluid through the speeds they rebound into their fluid neighbours, so
+** it stores the owned fluid cells, the owned obstacles with a fluid neighbour
+** and the halos, and drops solid interiors. The table of where each speed
+** streams from replaces the neighbour arithmetic and the obstacle test, so
+** the work and memory go with the fluid cells and the results are identical
+** to the dense pull step.
+*/
+void sparse_create(t_sparse* sparse, const t_param params, t_speed_arrays* cells, unsigned char* obstacles)
+{
+  static const int all_speeds[NSPEEDS] = {0, 1, 2, 3, 4, 5, 6, 7, 8};
+  static const int to_left[3] = {3, 6, 7};
+  static const int to_right[3] = {1, 5, 8};
+  static const int to_down[3] = {4, 7, 8};
+  static const int to_up[3] = {2, 5, 6};
+  static const int dx[NSPEEDS] = {0, 1, 0, -1, 0, 1, -1, -1, 1};
+  static const int dy[NSPEEDS] = {0, 0, 1, 0, -1, 1, 1, -1, -1};
+  int nx = params.nx;
+  int ny = params.ny;
+  int pitch = params.pitch;
+  int hr = params.halo_rows;
+  int* position = (int*) malloc(pitch * ny * sizeof(int));  /* stored cell of each dense cell, -1 if dropped */
+  if(position == NULL) die("cannot allocate memory for the sparse lattice", __LINE__, __FILE__);
+
+  //owned fluid cells, then owned obstacles with a fluid neighbour, then the halos
+  int n = 0;
+  for(int ii = 0; ii < pitch * ny; ++ii) position[ii] = -1;
+  for(int jj = hr; jj < ny - hr; ++jj) {
+    for(int ii = 1; ii < nx - 1; ++ii) {
+      if(!obstacles[ii + jj*pitch]) position[ii + jj*pitch] = n++;
+    }
+  }
+  sparse->nfluid = n;
+  for(int jj = hr; jj < ny - hr; ++jj) {
+    for(int ii = 1; ii < nx - 1; ++ii) {
+      if(!obstacles[ii + jj*pitch]) continue;
+      for(int kk = 1; kk < NSPEEDS; ++kk) {
+        if(!obstacles[(ii + dx[kk]) + (jj + dy[kk])*pitch]) {
+          position[ii + jj*pitch] = n++;
+          break;
+        }
+      }
+    }
+  }
+  sparse->nupdated = n;
+  for(int jj = 0; jj < ny; ++jj) {
+    for(int ii = 0; ii < nx; ++ii) {
+      if(jj < hr || jj >= ny - hr || ii == 0 || ii == nx - 1) position[ii + jj*pitch] = n++;
+    }
+  }
+  int dummy = n++;
+  sparse->ncells = n;
+
+  sparse->index = (int*) malloc(dummy * sizeof(int));
+  for(int ii = 0; ii < pitch * ny; ++ii) {
+    if(position[ii] >= 0) sparse->index[position[ii]] = ii;
+  }
+  sparse->source[0] = NULL;
+  for(int kk = 1; kk < NSPEEDS; ++kk) {
+    sparse->source[kk] = (int*) malloc(sparse->nupdated * sizeof(int));
+    for(int cell = 0; cell < sparse->nupdated; ++cell) {
+      int ii = sparse->index[cell] % pitch;
+      int jj = sparse->index[cell] / pitch;
+      int from = position[(ii - dx[kk]) + (jj - dy[kk])*pitch];
+      sparse->source[kk][cell] = (from >= 0) ? from : dummy;
+    }
+  }
+  sparse->naccel = 0;
+  sparse->accel = (int*) malloc(nx * sizeof(int));
+  if(params.accel_row >= 0) {
+    for(int ii = 0; ii < nx; ++ii) {
+      int cell = position[ii + params.accel_row*pitch];
+      if(cell >= 0 && !obstacles[ii + params.accel_row*pitch]) sparse->accel[sparse->naccel++] = cell;
+    }
+  }
+
+  for(int ll = 0; ll < 2; ++ll) {
+    sparse->cells[ll] = alloc_speed_arena(n);
+    for(int kk = 0; kk < NSPEEDS; ++kk) {
+      memset(sparse->cells[ll]->speeds[kk], 0, n*sizeof(float));
+    }
+  }
+  for(int kk = 0; kk < NSPEEDS; ++kk) {
+    for(int cell = 0; cell < dummy; ++cell) {
+      sparse->cells[0]->speeds[kk][cell] = cells->speeds[kk][sparse->index[cell]];
+    }
+  }
+  sparse->current = 0;
+
+  //the same cols and rows as the dense pull exchange, dropped cells are sent from the dummy
+  int len = (nx > ny) ? nx : ny;
+  int* send = (int*) malloc(len * sizeof(int));
+  int* recv = (int*) malloc(len * sizeof(int));
+  int reduce = REDUCE_HALO_SPEED_ECHANGE;
+  const int* speeds[4] = {reduce ? to_left : all_speeds, reduce ? to_right : all_speeds,
+                          reduce ? to_down : all_speeds, reduce ? to_up : all_speeds};
+  const int send_line[4] = {1, nx - 2, 1, ny - 2};
+  const int recv_line[4] = {nx - 1, 0, ny - 1, 0};
+  for(int dir = 0; dir < 4; ++dir) {
+    int count = (dir < 2) ? ny : nx;
+    for(int ii = 0; ii < count; ++ii) {
+      int from = (dir < 2) ? send_line[dir] + ii*pitch : ii + send_line[dir]*pitch;
+      int to = (dir < 2) ? recv_line[dir] + ii*pitch : ii + recv_line[dir]*pitch;
+      send[ii] = (position[from] >= 0) ? position[from] : dummy;
+      recv[ii] = position[to];
+    }
+    for(int ll = 0; ll < 2; ++ll) {
+      sparse->halos[ll][dir].send = sparse_halo_type(sparse->cells[ll], speeds[dir], reduce ? 3 : NSPEEDS, send, count);
+      sparse->halos[ll][dir].recv = sparse_halo_type(sparse->cells[ll], speeds[dir], reduce ? 3 : NSPEEDS, recv, count);
+    }
+  }
+  free(send);
+  free(recv);
+  free(position);
+}
+
+/* datatype for the given speeds of the stored cells at positions, used with MPI_BOTTOM like halo_type() */
+MPI_Datatype sparse_halo_type(t_speed_arrays* cells, const int* speeds, int nspeeds, const int* positions, int n)
+{
+  MPI_Datatype line, halo;
+  int blocklengths[NSPEEDS];
+  MPI_Aint displacements[NSPEEDS];
+  MPI_Datatype types[NSPEEDS];
+
+  MPI_Type_create_indexed_block(n, 1, positions, MPI_FLOAT, &line);
+  for(int ii = 0; ii < nspeeds; ++ii) {
+    blocklengths[ii] = 1;
+    MPI_Get_address(cells->speeds[speeds[ii]], &displacements[ii]);
+    types[ii] = line;
+  }
+  MPI_Type_create_struct(nspeeds, blocklengths, displacements, types, &halo);
+  MPI_Type_commit(&halo);
+  MPI_Type_free(&line);
+
+  return halo;
+}
+
+/* accelerate_flow() on the current sparse lattice */
+void sparse_accelerate(const t_param params, t_sparse* sparse)
+{
+  t_speed_arrays* cells = sparse->cells[sparse->current];
+  float w1 = params.density * params.accel / 9.f;
+  float w2 = params.density * params.accel / 36.f;
+
+  #pragma omp parallel for schedule(static)
+  for (int ii = 0; ii < sparse->naccel; ii++)
+  {
+    int cell = sparse->accel[ii];
+    /* if we don't send a negative density */
+    if ((cells->speeds[3][cell] - w1) > 0.f
+        && (cells->speeds[6][cell] - w2) > 0.f
+        && (cells->speeds[7][cell] - w2) > 0.f)
+    {
+      /* increase 'east-side' densities */
+      cells->speeds[1][cell] += w1;
+      cells->speeds[5][cell] += w2;
+      cells->speeds[8][cell] += w2;
+      /* decrease 'west-side' densities */
+      cells->speeds[3][cell] -= w1;
+      cells->speeds[6][cell] -= w2;
+      cells->speeds[7][cell] -= w2;
+    }
+  }
+}
+
+/*
+** merged_row_ops() on the sparse lattice: pull every updated cell through the
+** source table, rebound the obstacles and collide the fluid cells with the
+** same arithmetic, then make the new lattice current. Returns the summed
+** velocity of the fluid cells like av_velocity().
+*/
+float sparse_timestep(const t_param params, t_sparse* sparse)
+{
+  static const int opposite[NSPEEDS] = {0, 3, 4, 1, 2, 7, 8, 5, 6};
+  t_speed_arrays*restrict cells = sparse->cells[sparse->current];
+  t_speed_arrays*restrict tmp_cells = sparse->cells[1 - sparse->current];
+  float tot_u = 0.f;         /* accumulated magnitudes of velocity for each cell */
+
+  /* obstacles only rebound what streams into them */
+  #pragma omp parallel for schedule(static)
+  for (int cell = sparse->nfluid; cell < sparse->nupdated; cell++)
+  {
+    tmp_cells->speeds[0][cell] = cells->speeds[0][cell];
+    for (int kk = 1; kk < NSPEEDS; kk++)
+    {
+      tmp_cells->speeds[kk][cell] = cells->speeds[opposite[kk]][sparse->source[opposite[kk]][cell]];
+    }
+  }
+
+  /* fluid cells in chunks of about a row */
+  const int chunk = 1024;
+  #pragma omp parallel for schedule(static) reduction(+:tot_u)
+  for (int start = 0; start < sparse->nfluid; start += chunk)
+  {
+    tot_u += sparse_fluid_kernel(params, sparse, cells, tmp_cells, start, min(start + chunk, sparse->nfluid));
+  }
+  sparse->current = 1 - sparse->current;
+
+  return tot_u;
+}
+
+/* sparse_timestep() for fluid cells [start, end), as merged_row_ops() */
+float sparse_fluid_ops(const t_param params, const t_sparse* sparse, t_speed_arrays*restrict cells,
+                       t_speed_arrays*restrict tmp_cells, int start, int end)
+{
+  const float c_sq = 1.f / 3.f; /* square of speed of sound */
+  const float w0 = 4.f / 9.f;  /* weighting factor */
+  const float w1 = 1.f / 9.f;  /* weighting factor */
+  const float w2 = 1.f / 36.f; /* weighting factor */
+  float tot_u = 0.f;         /* accumulated magnitudes of velocity for each cell */
+
+  for (int cell = start; cell < end; cell++)
+  {
+    float d[NSPEEDS];
+    d[0] = cells->speeds[0][cell];
+    for (int kk = 1; kk < NSPEEDS; kk++)
+    {
+      d[kk] = cells->speeds[kk][sparse->source[kk][cell]];
+    }
+
+    /* compute local density total */
+    float local_density = 0.f;
+    for (int kk = 0; kk < NSPEEDS; kk++)
+    {
+      local_density += d[kk];
+    }
+    /* compute x velocity component */
+    float u_x = (d[1] + d[5] + d[8] - (d[3] + d[6] + d[7])) / local_density;
+    /* compute y velocity component */
+    float u_y = (d[2] + d[5] + d[6] - (d[4] + d[7] + d[8])) / local_density;
+    /* velocity squared */
+    float u_sq = u_x * u_x + u_y * u_y;
+
+    /* directional velocity components */
+    float u[NSPEEDS];
+    u[1] =   u_x;        /* east */
+    u[2] =         u_y;  /* north */
+    u[3] = - u_x;        /* west */
+    u[4] =       - u_y;  /* south */
+    u[5] =   u_x + u_y;  /* north-east */
+    u[6] = - u_x + u_y;  /* north-west */
+    u[7] = - u_x - u_y;  /* south-west */
+    u[8] =   u_x - u_y;  /* south-east */
+
+    /* equilibrium densities */
+    float d_equ[NSPEEDS];
+    d_equ[0] = w0 * local_density * (1.f - u_sq / (2.f * c_sq));
+    for (int kk = 1; kk < NSPEEDS; kk++)
+    {
+      d_equ[kk] = ((kk < 5) ? w1 : w2) * local_density * (1.f + u[kk] / c_sq
+                                                          + (u[kk] * u[kk]) / (2.f * c_sq * c_sq)
+                                                          - u_sq / (2.f * c_sq));
+    }
+
+    /* relaxation step */
+    for (int kk = 0; kk < NSPEEDS; kk++)
+    {
+      d[kk] = d[kk] + params.omega * (d_equ[kk] - d[kk]);
+      tmp_cells->speeds[kk][cell] = d[kk];
+    }
+
+    /* velocity of the new state, as av_velocity() */
+    local_density = 0.f;
+    for (int kk = 0; kk < NSPEEDS; kk++)
+    {
+      local_density += d[kk];
+    }
+    u_x = (d[1] + d[5] + d[8] - (d[3] + d[6] + d[7])) / local_density;
+    u_y = (d[2] + d[5] + d[6] - (d[4] + d[7] + d[8])) / local_density;
+    tot_u += sqrtf((u_x * u_x) + (u_y * u_y));
+  }
+
+  return tot_u;
+}
+
+#if HAVE_X86_SIMD
+/*
+** Vectorised versions of sparse_fluid_ops, with the pull done by gathers
+** through the source table. Same arithmetic as merged_row_ops_avx2/avx512,
+** so the results are bit-identical to the scalar kernel.
+*/
+__attribute__((target("avx2")))
+float sparse_fluid_ops_avx2(const t_param params, const t_sparse* sparse, t_speed_arrays*restrict cells,
+                            t_speed_arrays*restrict tmp_cells, int start, int end)
+{
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 one = _mm256_set1_ps(1.f);
+  const __m256 c_sq = _mm256_set1_ps(1.f / 3.f);                       /* square of speed of sound */
+  const __m256 two_c_sq = _mm256_set1_ps(2.f * (1.f / 3.f));
+  const __m256 two_c_sq_sq = _mm256_set1_ps(2.f * (1.f / 3.f) * (1.f / 3.f));
+  const __m256 w0 = _mm256_set1_ps(4.f / 9.f);
+  const __m256 w1 = _mm256_set1_ps(1.f / 9.f);
+  const __m256 w2 = _mm256_set1_ps(1.f / 36.f);
+  const __m256 omega = _mm256_set1_ps(params.omega);
+  __m256 acc = zero;
+
+  int cell = start;
+  for(; cell + 8 <= end; cell += 8) {
+    /* propagate */
+    __m256 f[NSPEEDS];
+    f[0] = _mm256_loadu_ps(&cells->speeds[0][cell]);
+    for(int kk = 1; kk < NSPEEDS; ++kk) {
+      __m256i source = _mm256_loadu_si256((const __m256i*) &sparse->source[kk][cell]);
+      f[kk] = _mm256_i32gather_ps(cells->speeds[kk], source, 4);
+    }
+
+    /* collision */
+    __m256 local_density = f[0];
+    for(int kk = 1; kk < NSPEEDS; ++kk) {
+      local_density = _mm256_add_ps(local_density, f[kk]);
+    }
+    __m256 u_x = _mm256_div_ps(_mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(f[1], f[5]), f[8]),
+                                             _mm256_add_ps(_mm256_add_ps(f[3], f[6]), f[7])), local_density);
+    __m256 u_y = _mm256_div_ps(_mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(f[2], f[5]), f[6]),
+                                             _mm256_add_ps(_mm256_add_ps(f[4], f[7]), f[8])), local_density);
+    __m256 u_sq_term = _mm256_div_ps(_mm256_add_ps(_mm256_mul_ps(u_x, u_x), _mm256_mul_ps(u_y, u_y)), two_c_sq);
+
+    __m256 u[NSPEEDS];
+    u[1] = u_x;
+    u[2] = u_y;
+    u[3] = _mm256_sub_ps(zero, u_x);
+    u[4] = _mm256_sub_ps(zero, u_y);
+    u[5] = _mm256_add_ps(u_x, u_y);
+    u[6] = _mm256_sub_ps(u_y, u_x);
+    u[7] = _mm256_sub_ps(zero, u[5]);
+    u[8] = _mm256_sub_ps(u_x, u_y);
+
+    __m256 w1_density = _mm256_mul_ps(w1, local_density);
+    __m256 w2_density = _mm256_mul_ps(w2, local_density);
+    __m256 d_equ[NSPEEDS];
+    d_equ[0] = _mm256_mul_ps(_mm256_mul_ps(w0, local_density), _mm256_sub_ps(one, u_sq_term));
+    for(int kk = 1; kk < NSPEEDS; ++kk) {
+      d_equ[kk] = _mm256_mul_ps((kk < 5) ? w1_density : w2_density,
+                                _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(one, _mm256_div_ps(u[kk], c_sq)),
+                                                            _mm256_div_ps(_mm256_mul_ps(u[kk], u[kk]), two_c_sq_sq)),
+                                              u_sq_term));
+    }
+
+    /* relaxation */
+    __m256 out[NSPEEDS];
+    local_density = zero;
+    for(int kk = 0; kk < NSPEEDS; ++kk) {
+      out[kk] = _mm256_add_ps(f[kk], _mm256_mul_ps(omega, _mm256_sub_ps(d_equ[kk], f[kk])));
+      _mm256_storeu_ps(&tmp_cells->speeds[kk][cell], out[kk]);
+      local_density = _mm256_add_ps(local_density, out[kk]);
+    }
+
+    /* av_velocity */
+    u_x = _mm256_div_ps(_mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(out[1], out[5]), out[8]),
+                                      _mm256_add_ps(_mm256_add_ps(out[3], out[6]), out[7])), local_density);
+    u_y = _mm256_div_ps(_mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(out[2], out[5]), out[6]),
+                                      _mm256_add_ps(_mm256_add_ps(out[4], out[7]), out[8])), local_density);
+    acc = _mm256_add_ps(acc, _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(u_x, u_x), _mm256_mul_ps(u_y, u_y))));
+  }
+  float tot_u = sparse_fluid_ops(params, sparse, cells, tmp_cells, cell, end);
+
+  float lanes[8];
+  _mm256_storeu_ps(lanes, acc);
+  for(int lane = 0; lane < 8; ++lane) {
+    tot_u += lanes[lane];
+  }
+  return tot_u;
+}
+
+__attribute__((target("avx512f")))
+float sparse_fluid_ops_avx512(const t_param params, const t_sparse* sparse, t_speed_arrays*restrict cells,
+                              t_speed_arrays*restrict tmp_cells, int start, int end)
+{
+  const __m512 zero = _mm512_setzero_ps();
+  const __m512 one = _mm512_set1_ps(1.f);
+  const __m512 c_sq = _mm512_set1_ps(1.f / 3.f);                       /* square of speed of sound */
+  const __m512 two_c_sq = _mm512_set1_ps(2.f * (1.f / 3.f));
+  const __m512 two_c_sq_sq = _mm512_set1_ps(2.f * (1.f / 3.f) * (1.f / 3.f));
+  const __m512 w0 = _mm512_set1_ps(4.f / 9.f);
+  const __m512 w1 = _mm512_set1_ps(1.f / 9.f);
+  const __m512 w2 = _mm512_set1_ps(1.f / 36.f);
+  const __m512 omega = _mm512_set1_ps(params.omega);
+  __m512 acc = zero;
+
+  int cell = start;
+  for(; cell + 16 <= end; cell += 16) {
+    /* propagate */
+    __m512 f[NSPEEDS];
+    f[0] = _mm512_loadu_ps(&cells->speeds[0][cell]);
+    for(int kk = 1; kk < NSPEEDS; ++kk) {
+      __m512i source = _mm512_loadu_si512(&sparse->source[kk][cell]);
+      f[kk] = _mm512_i32gather_ps(source, cells->speeds[kk], 4);
+    }
+
+    /* collision */
+    __m512 local_density = f[0];
+    for(int kk = 1; kk < NSPEEDS; ++kk) {
+      local_density = _mm512_add_ps(local_density, f[kk]);
+    }
+    __m512 u_x = _mm512_div_ps(_mm512_sub_ps(_mm512_add_ps(_mm512_add_ps(f[1], f[5]), f[8]),
+                                             _mm512_add_ps(_mm512_add_ps(f[3], f[6]), f[7])), local_density);
+    __m512 u_y = _mm512_div_ps(_mm512_sub_ps(_mm512_add_ps(_mm512_add_ps(f[2], f[5]), f[6]),
+                                             _mm512_add_ps(_mm512_add_ps(f[4], f[7]), f[8])), local_density);
+    __m512 u_sq_term = _mm512_div_ps(_mm512_add_ps(_mm512_mul_ps(u_x, u_x), _mm512_mul_ps(u_y, u_y)), two_c_sq);
+
+    __m512 u[NSPEEDS];
+    u[1] = u_x;
+    u[2] = u_y;
+    u[3] = _mm512_sub_ps(zero, u_x);
+    u[4] = _mm512_sub_ps(zero, u_y);
+    u[5] = _mm512_add_ps(u_x, u_y);
+    u[6] = _mm512_sub_ps(u_y, u_x);
+    u[7] = _mm512_sub_ps(zero, u[5]);
+    u[8] = _mm512_sub_ps(u_x, u_y);
+
+    __m512 w1_density = _mm512_mul_ps(w1, local_density);
+    __m512 w2_density = _mm512_mul_ps(w2, local_density);
+    __m512 d_equ[NSPEEDS];
+    d_equ[0] = _mm512_mul_ps(_mm512_mul_ps(w0, local_density), _mm512_sub_ps(one, u_sq_term));
+    for(int kk = 1; kk < NSPEEDS; ++kk) {
+      d_equ[kk] = _mm512_mul_ps((kk < 5) ? w1_density : w2_density,
+                                _mm512_sub_ps(_mm512_add_ps(_mm512_add_ps(one, _mm512_div_ps(u[kk], c_sq)),
+                                                            _mm512_div_ps(_mm512_mul_ps(u[kk], u[kk]), two_c_sq_sq)),
+                                              u_sq_term));
+    }
+
+    /* relaxation */
+    __m512 out[NSPEEDS];
+    local_density = zero;
+    for(int kk = 0; kk < NSPEEDS; ++kk) {
+      out[kk] = _mm512_add_ps(f[kk], _mm512_mul_ps(omega, _mm512_sub_ps(d_equ[kk], f[kk])));
+      _mm512_storeu_ps(&tmp_cells->speeds[kk][cell], out[kk]);
+      local_density = _mm512_add_ps(local_density, out[kk]);
+    }
+
+    /* av_velocity */
+    u_x = _mm512_div_ps(_mm512_sub_ps(_mm512_add_ps(_mm512_add_ps(out[1], out[5]), out[8]),
+                                      _mm512_add_ps(_mm512_add_ps(out[3], out[6]), out[7])), local_density);
+    u_y = _mm512_div_ps(_mm512_sub_ps(_mm512_add_ps(_mm512_add_ps(out[2], out[5]), out[6]),
+                                      _mm512_add_ps(_mm512_add_ps(out[4], out[7]), out[8])), local_density);
+    acc = _mm512_add_ps(acc, _mm512_sqrt_ps(_mm512_add_ps(_mm512_mul_ps(u_x, u_x), _mm512_mul_ps(u_y, u_y))));
+  }
+  float tot_u = sparse_fluid_ops(params, sparse, cells, tmp_cells, cell, end);
+
+  return tot_u + _mm512_reduce_add_ps(acc);
+}
+#endif
+
+/* a dense lattice holding the current sparse one, zero where no cell is stored */
+t_speed_arrays* sparse_to_dense(const t_param params, const t_sparse* sparse)
+{
+  t_speed_arrays* cells = create_t_speed_arrays(params);
+  const t_speed_arrays* current = sparse->cells[sparse->current];
+  for(int kk = 0; kk < NSPEEDS; ++kk) {
+    for(int cell = 0; cell < sparse->ncells - 1; ++cell) {
+      cells->speeds[kk][sparse->index[cell]] = current->speeds[kk][cell];
+    }
+  }
+  return cells;
+}
+
+void sparse_free(t_sparse* sparse)
+{
+  for(int ll = 0; ll < 2; ++ll) {
+    for(int dir = 0; dir < 4; ++dir) {
+      MPI_Type_free(&sparse->halos[ll][dir].send);
+      MPI_Type_free(&sparse->halos[ll][dir].recv);
+    }
+    free_t_speed_arrays(sparse->cells[ll]);
+  }
+  for(int kk = 1; kk < NSPEEDS; ++kk) {
+    free(sparse->source[kk]);
+  }
+  free(sparse->index);
+  free(sparse->accel);
+}
+
+/*
+** A lattice storing the speeds as 16 bit floats, which halves the bytes every
+** step streams. It is the arena of a pitch*ny/2 float lattice, with speeds[]
+** cleared so only the half[] view of it is used. The rows are first touched
+** like create_t_speed_arrays().
+*/
+t_speed_arrays* create_half_speed_arrays(t_param params) {
+  t_speed_arrays* object_ptr = alloc_speed_arena((params.pitch*params.ny + 1) / 2);
+  for(int kk = 0; kk < NSPEEDS; ++kk) {
+    object_ptr->half[kk] = (unsigned short*) object_ptr->speeds[kk];
+    object_ptr->speeds[kk] = NULL;
+  }
+  #pragma omp parallel for schedule(static)
+  for(int jj = 0; jj < params.ny; ++jj) {
+    for(int kk = 0; kk < NSPEEDS; ++kk) {
+      memset(&object_ptr->half[kk][jj*params.pitch], 0, params.pitch*sizeof(unsigned short));
+    }
+  }
+  return object_ptr;
+}
+
+/*
+** Subtracted from speed kk before it is stored. With HALF_STORAGE 3 that is
+** its value at rest, so the 11 bits of an fp16 hold the small deviation from
+** it instead of the whole value, which keeps about 3 more decimal digits.
+*/
+float half_bias(const t_param params, int kk)
+{
+  if(HALF_STORAGE != 3) return 0.f;
+  return params.density * ((kk == 0) ? 4.f / 9.f : (kk < 5) ? 1.f / 9.f : 1.f / 36.f);
+}
+
+/*
+** Round to the 16 bit storage format, to nearest even like the F16C
+** instructions: bf16 with HALF_STORAGE 1, IEEE fp16 with gradual underflow
+** otherwise. The fp16 conversions scale through the float exponent range
+** instead of branching on the cases.
+*/
+unsigned short half_encode(float value)
+{
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  if(HALF_STORAGE == 1) {
+    return (unsigned short) ((bits + 0x7fff + ((bits >> 16) & 1)) >> 16);
+  }
+  uint32_t sign = bits & 0x80000000u;
+  uint32_t shl1 = bits + bits;
+  uint32_t bias = shl1 & 0xff000000u;
+  if(bias < 0x71000000u) bias = 0x71000000u;
+  float base = (fabsf(value) * 0x1.0p+112f) * 0x1.0p-110f;
+  uint32_t bias_bits = (bias >> 1) + 0x07800000u;
+  float bias_value;
+  memcpy(&bias_value, &bias_bits, sizeof(bias_value));
+  base = bias_value + base;
+  memcpy(&bits, &base, sizeof(bits));
+  uint32_t nonsign = ((bits >> 13) & 0x00007c00u) + (bits & 0x00000fffu);
+  return (unsigned short) ((sign >> 16) | (shl1 > 0xff000000u ? 0x7e00u : nonsign));
+}
+
+float half_decode(unsigned short value)
+{
+  uint32_t bits = (uint32_t) value << 16;
+  float result;
+  if(HALF_STORAGE == 1) {
+    memcpy(&result, &bits, sizeof(result));
+    return result;
+  }
+  uint32_t sign = bits & 0x80000000u;
+  uint32_t shl1 = bits + bits;
+  uint32_t normal_bits = (shl1 >> 4) + (0xe0u << 23);
+  uint32_t subnormal_bits = (shl1 >> 17) | (126u << 23);
+  float normal, subnormal;
+  memcpy(&normal, &normal_bits, sizeof(normal));
+  memcpy(&subnormal, &subnormal_bits, sizeof(subnormal));
+  normal *= 0x1.0p-112f;
+  subnormal -= 0.5f;
+  memcpy(&bits, (shl1 < (1u << 27)) ? &subnormal : &normal, sizeof(bits));
+  bits |= sign;
+  memcpy(&result, &bits, sizeof(result));
+  return result;
+}
+
+void half_from_dense(const t_param params, const t_speed_arrays* cells, t_speed_arrays* half)
+{
+  for(int kk = 0; kk < NSPEEDS; ++kk) {
+    float bias = half_bias(params, kk);
+    #pragma omp parallel for schedule(static)
+    for(int jj = 0; jj < params.ny; ++jj) {
+      for(int ii = 0; ii < params.nx; ++ii) {
+        half->half[kk][ii + jj*params.pitch] = half_encode(cells->speeds[kk][ii + jj*params.pitch] - bias);
+      }
+    }
+  }
+}
+
+/* a float lattice of the 16 bit one, for the checkpoints and the output */
+t_speed_arrays* half_to_dense(const t_param params, const t_speed_arrays* half)
+{
+  t_speed_arrays* cells = create_t_speed_arrays(params);
+  for(int kk = 0; kk < NSPEEDS; ++kk) {
+    float bias = half_bias(params, kk);
+    #pragma omp parallel for schedule(static)
+    for(int jj = 0; jj < params.ny; ++jj) {
+      for(int ii = 0; ii < params.nx; ++ii) {
+        cells->speeds[kk][ii + jj*params.pitch] = half_decode(half->half[kk][ii + jj*params.pitch]) + bias;
+      }
+    }
+  }
+  return cells;
+}
+
+/* accelerate_flow() on a 16 bit lattice, the whole accelerated row including its halos */
+void half_accelerate(const t_param params, t_speed_arrays* cells, unsigned char* obstacles)
+{
+  static const int east[3] = {1, 5, 8};
+  static const int west[3] = {3, 6, 7};
+  float w[3];
+  w[0] = params.density * params.accel / 9.f;
+  w[1] = w[2] = params.density * params.accel / 36.f;
+
+  if(params.accel_row < 0) return;
+  for (int jj = params.accel_row; jj < params.ny; jj += params.accel_stride)
+  {
+    #pragma omp parallel for schedule(static)
+    for (int ii = 0; ii < params.nx; ii++)
+    {
+      int index = ii + jj*params.pitch;
+      float f_east[3], f_west[3];
+      for (int kk = 0; kk < 3; kk++)
+      {
+        f_east[kk] = half_decode(cells->half[east[kk]][index]) + half_bias(params, east[kk]);
+        f_west[kk] = half_decode(cells->half[west[kk]][index]) + half_bias(params, west[kk]);
+      }
+      /* if the cell is not occupied and
+      ** we don't send a negative density */
+      if (!obstacles[index] && (f_west[0] - w[0]) > 0.f && (f_west[1] - w[1]) > 0.f && (f_west[2] - w[2]) > 0.f)
+      {
+        for (int kk = 0; kk < 3; kk++)
+        {
+          cells->half[east[kk]][index] = half_encode(f_east[kk] + w[kk] - half_bias(params, east[kk]));
+          cells->half[west[kk]][index] = half_encode(f_west[kk] - w[kk] - half_bias(params, west[kk]));
+        }
+      }
+    }
+  }
+}
+
+/*
+** merged_timestep_ops() on 16 bit lattices: every owned cell is pulled and
+** widened to fp32, collided or rebounded in fp32 and rounded back on the
+** store, so only the storage loses precision.
+*/
+float half_timestep_ops(const t_param params, t_speed_arrays*restrict cells, t_speed_arrays*restrict tmp_cells,
+                        unsigned char*restrict obstacles)
+{
+  float tot_u = 0.f;         /* accumulated magnitudes of velocity for each cell */
+  #pragma omp parallel for schedule(static) reduction(+:tot_u)
+  for (int jj = params.halo_rows; jj < params.ny - params.halo_rows; jj++)
+  {
+    tot_u += half_row_kernel(params, cells, tmp_cells, obstacles, jj, 1, params.nx - 1);
+  }
+  return tot_u;
+}
+
+float merged_row_ops_half(const t_param params, t_speed_arrays*restrict cells, t_speed_arrays*restrict tmp_cells,
+                          unsigned char*restrict obstacles, int jj, int start, int end)
+{
+  static const int opposite[NSPEEDS] = {0, 3, 4, 1, 2, 7, 8, 5, 6};
+  const int row = jj*params.pitch;
+  const int row_n = row + params.pitch;
+  const int row_s = row - params.pitch;
+  /* the cell each speed streams from, relative to ii */
+  const int source[NSPEEDS] = {row, row - 1, row_s, row + 1, row_n, row_s - 1, row_s + 1, row_n + 1, row_n - 1};
+  float bias[NSPEEDS];
+  for (int kk = 0; kk < NSPEEDS; kk++)
+  {
+    bias[kk] = half_bias(params, kk);
+  }
+
+  float tot_u = 0.f;
+  for (int ii = start; ii < end; ii++)
+  {
+    float f[NSPEEDS];
+    for (int kk = 0; kk < NSPEEDS; kk++)
+    {
+      f[kk] = half_decode(cells->half[kk][ii + source[kk]]) + bias[kk];
+    }
+    if (obstacles[ii + row])
+    {
+      for (int kk = 0; kk < NSPEEDS; kk++)
+      {
+        tmp_cells->half[kk][ii + row] = half_encode(f[opposite[kk]] - bias[kk]);
+      }
+    }
+    else
+    {
+      collide_cell(params, f);
+      for (int kk = 0; kk < NSPEEDS; kk++)
+      {
+        tmp_cells->half[kk][ii + row] = half_encode(f[kk] - bias[kk]);
+      }
+      tot_u += cell_velocity(f);
+    }
+  }
+  return tot_u;
+}
+
+#if HAVE_X86_SIMD
+/* 8 stored speeds widened to fp32, bf16 by a shift or fp16 with F16C */
+__attribute__((target("avx2,f16c")))
+__m256 half_load8(const unsigned short* values)
+{
+  __m128i stored = _mm_loadu_si128((const __m128i*) values);
+  if(HALF_STORAGE == 1) return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(stored), 16));
+  return _mm256_cvtph_ps(stored);
+}
+
+/* 8 fp32 values rounded to nearest even into the storage format, as half_encode() */
+__attribute__((target("avx2,f16c")))
+void half_store8(unsigned short* values, __m256 v)
+{
+  __m128i stored;
+  if(HALF_STORAGE == 1) {
+    __m256i bits = _mm256_castps_si256(v);
+    __m256i odd = _mm256_and_si256(_mm256_srli_epi32(bits, 16), _mm256_set1_epi32(1));
+    bits = _mm256_srli_epi32(_mm256_add_epi32(bits, _mm256_add_epi32(odd, _mm256_set1_epi32(0x7fff))), 16);
+    //pack within each 128 bit lane, then pull the two low halves together
+    bits = _mm256_permute4x64_epi64(_mm256_packus_epi32(bits, bits), 0x08);
+    stored = _mm256_castsi256_si128(bits);
+  } else {
+    stored = _mm256_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT);
+  }
+  _mm_storeu_si128((__m128i*) values, stored);
+}
+
+/* merged_row_ops_half() eight cells at a time, with the arithmetic of merged_row_ops_avx2() */
+__attribute__((target("avx2,f16c")))
+float merged_row_ops_half_avx2(const t_param params, t_speed_arrays*restrict cells, t_speed_arrays*restrict tmp_cells,
+                               unsigned char*restrict obstacles, int jj, int start, int end) {
+  static const int opposite[NSPEEDS] = {0, 3, 4, 1, 2, 7, 8, 5, 6};
+  if(end - start < 8) {
+    return merged_row_ops_half(params, cells, tmp_cells, obstacles, jj, start, end);
+  }
+
+  const int row = jj*params.pitch;
+  const int row_n = row + params.pitch;
+  const int row_s = row - params.pitch;
+  const int source[NSPEEDS] = {row, row - 1, row_s, row + 1, row_n, row_s - 1, row_s + 1, row_n + 1, row_n - 1};
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 one = _mm256_set1_ps(1.f);
+  const __m256 c_sq = _mm256_set1_ps(1.f / 3.f);                       /* square of speed of sound */
+  const __m256 two_c_sq = _mm256_set1_ps(2.f * (1.f / 3.f));
+  const __m256 two_c_sq_sq = _mm256_set1_ps(2.f * (1.f / 3.f) * (1.f / 3.f));
+  const __m256 w0 = _mm256_set1_ps(4.f / 9.f);
+  const __m256 w1 = _mm256_set1_ps(1.f / 9.f);
+  const __m256 w2 = _mm256_set1_ps(1.f / 36.f);
+  const __m256 omega = _mm256_set1_ps(params.omega);
+  __m256 bias[NSPEEDS];
+  for(int kk = 0; kk < NSPEEDS; ++kk) {
+    bias[kk] = _mm256_set1_ps(half_bias(params, kk));
+  }
+  __m256 acc = zero;
+
+  float tot_u = 0.f;
+  int ii = start;
+  for(; ii + 8 <= end; ii += 8) {
+    /* propagate */
+    __m256 f[NSPEEDS];
+    for(int kk = 0; kk < NSPEEDS; ++kk) {
+      f[kk] = _mm256_add_ps(half_load8(&cells->half[kk][ii + source[kk]]), bias[kk]);
+    }
+
+    /* all bits set in lanes without an obstacle, widened from 8 mask bytes */
+    __m256i blocked = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*) &obstacles[ii + row]));
+    __m256 fluid = _mm256_castsi256_ps(_mm256_cmpeq_epi32(blocked, _mm256_setzero_si256()));
+
+    /* collision */
+    __m256 local_density = f[0];
+    for(int kk = 1; kk < NSPEEDS; ++kk) {
+      local_density = _mm256_add_ps(local_density, f[kk]);
+    }
+    __m256 u_x = _mm256_div_ps(_mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(f[1], f[5]), f[8]),
+                                             _mm256_add_ps(_mm256_add_ps(f[3], f[6]), f[7])), local_density);
+    __m256 u_y = _mm256_div_ps(_mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(f[2], f[5]), f[6]),
+                                             _mm256_add_ps(_mm256_add_ps(f[4], f[7]), f[8])), local_density);
+    __m256 u_sq_term = _mm256_div_ps(_mm256_add_ps(_mm256_mul_ps(u_x, u_x), _mm256_mul_ps(u_y, u_y)), two_c_sq);
+
+    __m256 u[NSPEEDS];
+    u[1] = u_x;
+    u[2] = u_y;
+    u[3] = _mm256_sub_ps(zero, u_x);
+    u[4] = _mm256_sub_ps(zero, u_y);
+    u[5] = _mm256_add_ps(u_x, u_y);
+    u[6] = _mm256_sub_ps(u_y, u_x);
+    u[7] = _mm256_sub_ps(zero, u[5]);
+    u[8] = _mm256_sub_ps(u_x, u_y);
+
+    __m256 w1_density = _mm256_mul_ps(w1, local_density);
+    __m256 w2_density = _mm256_mul_ps(w2, local_density);
+    __m256 d_equ[NSPEEDS];
+    d_equ[0] = _mm256_mul_ps(_mm256_mul_ps(w0, local_density), _mm256_sub_ps(one, u_sq_term));
+    for(int kk = 1; kk < NSPEEDS; ++kk) {
+      d_equ[kk] = _mm256_mul_ps((kk < 5) ? w1_density : w2_density,
+                                _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(one, _mm256_div_ps(u[kk], c_sq)),
+                                                            _mm256_div_ps(_mm256_mul_ps(u[kk], u[kk]), two_c_sq_sq)),
+                                              u_sq_term));
+    }
+
+    /* relaxation for fluid lanes, rebound for obstacle lanes */
+    __m256 out[NSPEEDS];
+    for(int kk = 0; kk < NSPEEDS; ++kk) {
+      __m256 relaxed = _mm256_add_ps(f[kk], _mm256_mul_ps(omega, _mm256_sub_ps(d_equ[kk], f[kk])));
+      out[kk] = _mm256_blendv_ps(f[opposite[kk]], relaxed, fluid);
+      half_store8(&tmp_cells->half[kk][ii + row], _mm256_sub_ps(out[kk], bias[kk]));
+    }
+
+    /* av_velocity */
+    u_x = _mm256_div_ps(_mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(out[1], out[5]), out[8]),
+                                      _mm256_add_ps(_mm256_add_ps(out[3], out[6]), out[7])), local_density);
+    u_y = _mm256_div_ps(_mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(out[2], out[5]), out[6]),
+                                      _mm256_add_ps(_mm256_add_ps(out[4], out[7]), out[8])), local_density);
+    acc = _mm256_add_ps(acc, _mm256_and_ps(fluid,
+                          _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(u_x, u_x), _mm256_mul_ps(u_y, u_y)))));
+  }
+  tot_u += merged_row_ops_half(params, cells, tmp_cells, obstacles, jj, ii, end);
+
+  float lanes[8];
+  _mm256_storeu_ps(lanes, acc);
+  for(int lane = 0; lane < 8; ++lane) {
+    tot_u += lanes[lane];
+  }
+  return tot_u;
+}
+#endif
+
+void output_state(const char* output_file, int step, t_speed_arrays *cells, unsigned char *obstacles, int nx, int ny) {
+  FILE* fp = fopen(output_file, "a");
+  if (fp == NULL)
+  {
+    printf("could not open input parameter file: %s", output_file);
+    return;
+  }
+  fprintf(fp, "Step %d:\n", step);
+  for(int i = 0; i < ny; ++i) {
+    for(int j = 0; j < nx; ++j) {
+      for(int z = 0; z < 9; ++z) {
+        fprintf(fp, "%f ", cells->speeds[z][i*nx + j]);
+      }
+      fprintf(fp, "\n");
+    }
+    fprintf(fp, "\n");
+  }
+  for(int i = 0; i < ny; ++i) {
+    for(int j = 0; j < nx; ++j) {
+      fprintf(fp, "%d ", obstacles[i*nx + j]);
+    }
+    fprintf(fp, "\n");
+  }
+  fprintf(fp, "\n\n");
+  fclose(fp);
+}
+
+int calc_ncols_from_rank(int rank, int size, int nx)
+{
+  int ncols;
+
+  if(!SPREAD_COLS_EVENLY) {
+    ncols = nx / size;       /* integer division */
+    if ((nx % size) != 0) {  /* if there is a remainder */
+      if (rank == size - 1)
+        ncols += nx % size;  /* add remainder to last rank */
+    }
+  } else {
+    int per_process = nx / size;
+    int remainder_cols = nx % size;
+    ncols = per_process;
+    if(rank < remainder_cols) {
+      ++ncols;
+    }
+  }
+
+  return ncols;
+}
+
+/*
+** The process grid and the split of the grid over it. With LOAD_BALANCE the
+** splits weigh obstacle cells by obstacle_cost, or by measure_obstacle_cost()
+** if it is negative.
+*/
+void create_decomp(t_decomp* decomp, int size, const t_param params, const char* obstaclefile, float obstacle_cost)
+{
+  int periods[2] = {1, 1};  /* the grid is periodic in both directions */
+  int rank;
+
+  decomp->dims[0] = 0;
+  decomp->dims[1] = 0;
+  if(CART_2D) {
+    MPI_Dims_create(size, 2, decomp->dims);
+    //more processes along the longer side
+    if((params.nx < params.ny) != (decomp->dims[0] < decomp->dims[1])) {
+      int tmp = decomp->dims[0];
+      decomp->dims[0] = decomp->dims[1];
+      decomp->dims[1] = tmp;
+    }
+  } else {
+    decomp->dims[0] = size;
+    decomp->dims[1] = 1;
+  }
+  if(decomp->dims[0] > params.nx || decomp->dims[1] > params.ny) {
+    die("more processes than cols or rows in the grid", __LINE__, __FILE__);
+  }
+
+  //no reordering, so rank 0 is still the master and ranks match MPI_COMM_WORLD
+  MPI_Cart_create(MPI_COMM_WORLD, 2, decomp->dims, periods, 0, &decomp->comm);
+  MPI_Comm_rank(decomp->comm, &rank);
+  MPI_Cart_coords(decomp->comm, rank, 2, decomp->coords);
+  MPI_Cart_shift(decomp->comm, 0, 1, &decomp->left, &decomp->right);
+  MPI_Cart_shift(decomp->comm, 1, 1, &decomp->down, &decomp->up);
+  for(int corner = 0; corner < 4; ++corner) {
+    int coords[2] = {decomp->coords[0] + ((corner % 2) ? 1 : -1), decomp->coords[1] + ((corner / 2) ? 1 : -1)};
+    MPI_Cart_rank(decomp->comm, coords, &decomp->corners[corner]);
+  }
+
+  decomp->col_splits = (int*) malloc((decomp->dims[0] + 1) * sizeof(int));
+  decomp->row_splits = (int*) malloc((decomp->dims[1] + 1) * sizeof(int));
+  decomp->obstacle_cost = 1.f;
+  if(LOAD_BALANCE) {
+    //the master weighs every col and row by its cost and places the splits
+    if(rank == 0) {
+      int* col_obstacles = (int*) calloc(params.nx, sizeof(int));
+      int* row_obstacles = (int*) calloc(params.ny, sizeof(int));
+      double* col_weights = (double*) malloc(params.nx * sizeof(double));
+      double* row_weights = (double*) malloc(params.ny * sizeof(double));
+      count_obstacles(obstaclefile, params, col_obstacles, row_obstacles);
+      decomp->obstacle_cost = (obstacle_cost >= 0.f) ? obstacle_cost : measure_obstacle_cost(params);
+      for(int col = 0; col < params.nx; ++col) {
+        col_weights[col] = (params.ny - col_obstacles[col]) + decomp->obstacle_cost * col_obstacles[col];
+      }
+      for(int row = 0; row < params.ny; ++row) {
+        row_weights[row] = (params.nx - row_obstacles[row]) + decomp->obstacle_cost * row_obstacles[row];
+      }
+      balanced_splits(col_weights, params.nx, decomp->dims[0], decomp->col_splits);
+      balanced_splits(row_weights, params.ny, decomp->dims[1], decomp->row_splits);
+      free(col_obstacles);
+      free(row_obstacles);
+      free(col_weights);
+      free(row_weights);
+    }
+    MPI_Bcast(decomp->col_splits, decomp->dims[0] + 1, MPI_INT, 0, decomp->comm);
+    MPI_Bcast(decomp->row_splits, decomp->dims[1] + 1, MPI_INT, 0, decomp->comm);
+    MPI_Bcast(&decomp->obstacle_cost, 1, MPI_FLOAT, 0, decomp->comm);
+  } else {
+    for(int i = 0; i < decomp->dims[0]; ++i) {
+      decomp->col_splits[i] = start_process_grid_from(decomp->dims[0], i, params.nx);
+    }
+    decomp->col_splits[decomp->dims[0]] = params.nx;
+    for(int i = 0; i < decomp->dims[1]; ++i) {
+      decomp->row_splits[i] = start_process_grid_from(decomp->dims[1], i, params.ny);
+    }
+    decomp->row_splits[decomp->dims[1]] = params.ny;
+  }
+  decomp_block(decomp, rank, &decomp->start_col, &decomp->ncols, &decomp->start_row, &decomp->nrows);
+}
+
+void decomp_block(const t_decomp* decomp, int rank, int* start_col, int* ncols, int* start_row, int* nrows)
+{
+  int coords[2];
+  MPI_Cart_coords(decomp->comm, rank, 2, coords);
+  *start_col = decomp->col_splits[coords[0]];
+  *ncols = decomp->col_splits[coords[0] + 1] - *start_col;
+  *start_row = decomp->row_splits[coords[1]];
+  *nrows = decomp->row_splits[coords[1] + 1] - *start_row;
+}
+
+/*
+** A checkpoint holds a header of ints (nx, ny, maxIters, child nx, child ny,
+** start_col, start_row, iteration to resume at, child pitch, streaming mode,
+** bits of the obstacle cell cost, halo width, HALF_STORAGE), all NSPEEDS child
+** arrays including the halos, which AA_PATTERN needs between its two steps,
+** and the child velocity history. The arrays are in the layout of the
+** streaming mode, so it can only be resumed by the same mode, and only with
+** the same decomposition, which the saved obstacle cost rebuilds, see
+** checkpoint_obstacle_cost().
+*/
+#define CHECKPOINT_HEADER 13
+#define STREAMING_MODE (AA_PATTERN ? 1 : PUSH_STREAMING ? 2 : 0)  /* pull, AA or push */
+
+void checkpoint_init(t_checkpoint* checkpoint, int rank, const t_param params, const t_param child_params)
+{
+  sprintf(checkpoint->path, CHECKPOINTFILE, rank);
+  sprintf(checkpoint->tmp_path, CHECKPOINTFILE ".tmp", rank);
+  checkpoint->len = CHECKPOINT_HEADER * sizeof(int)
+                    + (size_t) NSPEEDS * child_params.pitch * child_params.ny * sizeof(float)
+                    + ((rank == 0) ? (size_t) params.maxIters * sizeof(float) : 0);
+  checkpoint->buffer = NULL;
+  checkpoint->pending = 0;
+  //every part is written with an int count of its own
+  if((size_t) child_params.pitch * child_params.ny > INT_MAX) {
+    die("child grid too large to checkpoint", __LINE__, __FILE__);
+  }
+}
+
+/*
+** Snapshot the state before iteration tt and write it to this process' file
+** with a nonblocking MPI-IO write, so the timestep loop carries on while it
+** drains. The previous checkpoint stays in place until the new one is
+** complete, see checkpoint_finish().
+*/
+void checkpoint_start(t_checkpoint* checkpoint, const t_decomp* decomp, const t_param params,
+                      const t_param child_params, t_speed_arrays* child_cells, float* av_vels, int tt)
+{
+  checkpoint_finish(checkpoint, 1);
+  checkpoint->buffer = (char*) malloc(checkpoint->len);
+  if(checkpoint->buffer == NULL) die("cannot allocate memory for checkpoint", __LINE__, __FILE__);
+
+  int header[CHECKPOINT_HEADER] = {params.nx, params.ny, params.maxIters, child_params.nx, child_params.ny,
+                                   decomp->start_col, decomp->start_row, tt, child_params.pitch,
+                                   STREAMING_MODE, 0, child_params.halo_cols, HALF_STORAGE};
+  memcpy(&header[10], &decomp->obstacle_cost, sizeof(float));
+  size_t cells_len = (size_t) child_params.pitch * child_params.ny * sizeof(float);
+  char* pos = checkpoint->buffer;
+  memcpy(pos, header, sizeof(header));
+  pos += sizeof(header);
+  for(int kk = 0; kk < NSPEEDS; ++kk) {
+    memcpy(pos, child_cells->speeds[kk], cells_len);
+    pos += cells_len;
+  }
+  if(av_vels) memcpy(pos, av_vels, params.maxIters * sizeof(float));
+
+  if(MPI_File_open(MPI_COMM_SELF, checkpoint->tmp_path, MPI_MODE_CREATE | MPI_MODE_WRONLY,
+                   MPI_INFO_NULL, &checkpoint->fh) != MPI_SUCCESS) {
+    die("could not open checkpoint file", __LINE__, __FILE__);
+  }
+  MPI_File_set_size(checkpoint->fh, checkpoint->len);
+  //in parts, a single byte count overflows an int beyond 2 GB
+  int cells_count = child_params.pitch * child_params.ny;
+  MPI_Offset offset = 0;
+  checkpoint->nrequests = 0;
+  MPI_File_iwrite_at(checkpoint->fh, offset, checkpoint->buffer, CHECKPOINT_HEADER, MPI_INT,
+                     &checkpoint->requests[checkpoint->nrequests++]);
+  offset += sizeof(header);
+  for(int kk = 0; kk < NSPEEDS; ++kk) {
+    MPI_File_iwrite_at(checkpoint->fh, offset, checkpoint->buffer + offset, cells_count, MPI_FLOAT,
+                       &checkpoint->requests[checkpoint->nrequests++]);
+    offset += cells_len;
+  }
+  if(av_vels) {
+    MPI_File_iwrite_at(checkpoint->fh, offset, checkpoint->buffer + offset, params.maxIters, MPI_FLOAT,
+                       &checkpoint->requests[checkpoint->nrequests++]);
+  }
+  checkpoint->pending = 1;
+}
+
+/*
+** Complete the checkpoint in flight, if any, move it over the previous one
+** and free its snapshot, so the lattice copy only lives while it is written.
+** Without wait it only does so if the write has already drained.
+*/
+void checkpoint_finish(t_checkpoint* checkpoint, int wait)
+{
+  if(!checkpoint->pending) return;
+
+  if(wait) {
+    MPI_Waitall(checkpoint->nrequests, checkpoint->requests, MPI_STATUSES_IGNORE);
+  } else {
+    int done;
+    MPI_Testall(checkpoint->nrequests, checkpoint->requests, &done, MPI_STATUSES_IGNORE);
+    if(!done) return;
+  }
+  MPI_File_close(&checkpoint->fh);
+  if(rename(checkpoint->tmp_path, checkpoint->path) != 0) {
+    die("could not rename checkpoint file", __LINE__, __FILE__);
+  }
+  free(checkpoint->buffer);
+  checkpoint->buffer = NULL;
+  checkpoint->pending = 0;
+}
+
+/*
+** The obstacle cell cost the master's checkpoint was split with, so a restart
+** places the same splits instead of weighing the obstacles again.
+*/
+float checkpoint_obstacle_cost(void)
+{
+  char   path[256];
+  char   message[1024];  /* message buffer */
+  FILE*  fp;             /* file pointer */
+  int    header[CHECKPOINT_HEADER];
+  float  obstacle_cost;
+
+  sprintf(path, CHECKPOINTFILE, 0);
+  fp = fopen(path, "rb");
+
+  if (fp == NULL)
+  {
+    sprintf(message, "could not open checkpoint file: %s", path);
+    die(message, __LINE__, __FILE__);
+  }
+
+  if (fread(header, sizeof(int), CHECKPOINT_HEADER, fp) != CHECKPOINT_HEADER)
+    die("could not read checkpoint header", __LINE__, __FILE__);
+
+  fclose(fp);
+
+  memcpy(&obstacle_cost, &header[10], sizeof(float));
+  return obstacle_cost;
+}
+
+/* load this process' checkpoint and return the iteration to resume at */
+int checkpoint_restore(t_checkpoint* checkpoint, const t_decomp* decomp, const t_param params,
+                       const t_param child_params, t_speed_arrays* child_cells, float* av_vels)
+{
+  char   message[1024];  /* message buffer */
+  FILE*  fp;             /* file pointer */
+  int    header[CHECKPOINT_HEADER];
+
+  fp = fopen(checkpoint->path, "rb");
+
+  if (fp == NULL)
+  {
+    sprintf(message, "could not open checkpoint file: %s", checkpoint->path);
+    die(message, __LINE__, __FILE__);
+  }
+
+  if (fread(header, sizeof(int), CHECKPOINT_HEADER, fp) != CHECKPOINT_HEADER)
+    die("could not read checkpoint header", __LINE__, __FILE__);
+
+  if (header[0] != params.nx || header[1] != params.ny || header[2] != params.maxIters
+      || header[3] != child_params.nx || header[4] != child_params.ny
+      || header[5] != decomp->start_col || header[6] != decomp->start_row || header[8] != child_params.pitch
+      || header[11] != child_params.halo_cols)
+    die("checkpoint was written by a different problem or decomposition", __LINE__, __FILE__);
+  if (header[9] != STREAMING_MODE || header[12] != HALF_STORAGE)
+    die("checkpoint was written with a different streaming mode or storage", __LINE__, __FILE__);
+
+  size_t cells_count = (size_t) child_params.pitch * child_params.ny;
+  for (int kk = 0; kk < NSPEEDS; ++kk)
+  {
+    if (fread(child_cells->speeds[kk], sizeof(float), cells_count, fp) != cells_count)
+      die("could not read checkpoint cells", __LINE__, __FILE__);
+  }
+
+  if (av_vels && fread(av_vels, sizeof(float), params.maxIters, fp) != (size_t) params.maxIters)
+    die("could not read checkpoint velocities", __LINE__, __FILE__);
+
+  fclose(fp);
+
+  return header[7];
+}
+
+/*
+** Velocities are summed over the processes in batches of up to VELS_BATCH
+** steps, each reduced to rank 0 with MPI_Ireduce while the following batch
+** is computed, so no process keeps more than two batches and rank 0 has the
+** average velocity of every batch that has landed.
+*/
+void vels_init(t_vels* vels, const t_param params, int rank, int tot_u)
+{
+  for(int ii = 0; ii < 2; ++ii) {
+    vels->sums[ii] = (float*) calloc(VELS_BATCH, sizeof(float));
+    if(vels->sums[ii] == NULL) die("cannot allocate memory for the velocities", __LINE__, __FILE__);
+  }
+  vels->current = 0;
+  vels->start = 0;
+  vels->request = MPI_REQUEST_NULL;
+  vels->flight_start = vels->flight_end = 0;
+  vels->av_vels = NULL;
+  if(rank == 0) {
+    vels->av_vels = (float*) calloc(params.maxIters, sizeof(float));
+    if(vels->av_vels == NULL) die("cannot allocate memory for the velocities", __LINE__, __FILE__);
+  }
+  vels->landed = 0;
+  vels->tot_u = tot_u;
+}
+
+/* where this process' velocity sum for step tt goes, which vels_reserve() has made room for */
+float* vels_at(t_vels* vels, int tt)
+{
+  return &vels->sums[vels->current][tt - vels->start];
+}
+
+/* make room for steps tt to tt + n - 1, sending the batch before tt off if it is too full for them */
+void vels_reserve(t_vels* vels, int tt, int n)
+{
+  if(tt + n > vels->start + VELS_BATCH) vels_flush(vels, tt, 0);
+}
+
+/*
+** Start the reduction of the steps before tt and begin the next batch at tt.
+** The batch before has to land first, as its buffer is the next one to fill.
+** Every process flushes at the same steps. With wait it lands at once.
+*/
+void vels_flush(t_vels* vels, int tt, int wait)
+{
+  vels_land(vels);
+  if(tt > vels->start) {
+    float* recv = vels->av_vels ? &vels->av_vels[vels->start] : NULL;
+    MPI_Ireduce(vels->sums[vels->current], recv, tt - vels->start, MPI_FLOAT, MPI_SUM, 0, MPI_COMM_WORLD,
+                &vels->request);
+    vels->flight_start = vels->start;
+    vels->flight_end = tt;
+    vels->current = !vels->current;
+  }
+  vels->start = tt;
+  if(wait) vels_land(vels);
+}
+
+/* complete the reduction in flight, if any, and average its steps on rank 0 */
+void vels_land(t_vels* vels)
+{
+  if(vels->request == MPI_REQUEST_NULL) return;
+  MPI_Wait(&vels->request, MPI_STATUS_IGNORE);
+  if(vels->av_vels) {
+    for(int tt = vels->flight_start; tt < vels->flight_end; ++tt) {
+      vels->av_vels[tt] /= vels->tot_u;
+    }
+    vels->landed = vels->flight_end;
+  }
+}
+
+/*
+** Datatype for a column of nrows cells in all NSPEEDS speed arrays, starting
+** at cells->speeds[kk][offset], with rows row_stride floats apart. The
+** arrays are separate allocations, so the type holds absolute addresses and
+** is used with MPI_BOTTOM. Its extent is one float, so count n of it covers
+** n neighbouring columns and displacements count cells.
+*/
+MPI_Datatype cells_column_type(const t_speed_arrays* cells, int offset, int nrows, int row_stride)
+{
+  MPI_Datatype column, speeds_column, cells_column;
+  int blocklengths[NSPEEDS];
+  MPI_Aint displacements[NSPEEDS];
+  MPI_Datatype types[NSPEEDS];
+
+  MPI_Type_vector(nrows, 1, row_stride, MPI_FLOAT, &column);
+  for(int kk = 0; kk < NSPEEDS; ++kk) {
+    blocklengths[kk] = 1;
+    MPI_Get_address(&cells->speeds[kk][offset], &displacements[kk]);
+    types[kk] = column;
+  }
+  MPI_Type_create_struct(NSPEEDS, blocklengths, displacements, types, &speeds_column);
+  MPI_Type_create_resized(speeds_column, 0, sizeof(float), &cells_column);
+  MPI_Type_commit(&cells_column);
+  MPI_Type_free(&column);
+  MPI_Type_free(&speeds_column);
+
+  return cells_column;
+}
+
+/* same as cells_column_type for the obstacle map, relative to the buffer */
+MPI_Datatype obstacles_column_type(int nrows, int row_stride)
+{
+  MPI_Datatype column, obstacles_column;
+
+  MPI_Type_vector(nrows, 1, row_stride, MPI_UNSIGNED_CHAR, &column);
+  MPI_Type_create_resized(column, 0, sizeof(unsigned char), &obstacles_column);
+  MPI_Type_commit(&obstacles_column);
+  MPI_Type_free(&column);
+
+  return obstacles_column;
+}
+
+/*
+** Gather the global rows [row, row + nrows) of all owned blocks on the master,
+** into band_cells and band_obstacles, params.nx wide and nrows high. The rows
+** must lie within one row of processes, which makes it one MPI_Gatherv of
+** columns with no packing on either side.
+*/
+void gather_rows(const t_decomp* decomp, const t_param params, const t_param child_params,
+                 t_speed_arrays* child_cells, unsigned char* child_obstacles, int row, int nrows,
+                 t_speed_arrays* band_cells, unsigned char* band_obstacles)
+{
+  int rank, size;
+  MPI_Comm_rank(decomp->comm, &rank);
+  MPI_Comm_size(decomp->comm, &size);
+
+  int process_row = 0;
+  while(decomp->row_splits[process_row + 1] <= row) ++process_row;
+
+  int ncols = 0;   /* columns this process sends */
+  int offset = 0;  /* first cell sent */
+  if(decomp->coords[1] == process_row) {
+    ncols = decomp->ncols;
+    offset = (row - decomp->start_row + child_params.halo_rows)*child_params.pitch + child_params.halo_cols;
+  }
+  MPI_Datatype child_cells_column = cells_column_type(child_cells, offset, nrows, child_params.pitch);
+  MPI_Datatype child_obstacles_column = obstacles_column_type(nrows, child_params.pitch);
+
+  int* counts = NULL;
+  int* displs = NULL;
+  MPI_Datatype cells_column = MPI_FLOAT;
+  MPI_Datatype obstacles_column = MPI_UNSIGNED_CHAR;
+  if(rank == 0) {
+    counts = (int*) malloc(size * sizeof(int));
+    displs = (int*) malloc(size * sizeof(int));
+    for(int process = 0; process < size; ++process) {
+      int coords[2];
+      int start_col, process_cols, start_row, process_rows;
+      MPI_Cart_coords(decomp->comm, process, 2, coords);
+      decomp_block(decomp, process, &start_col, &process_cols, &start_row, &process_rows);
+      counts[process] = (coords[1] == process_row) ? process_cols : 0;
+      displs[process] = (coords[1] == process_row) ? start_col : 0;
+    }
+    cells_column = cells_column_type(band_cells, 0, nrows, params.nx);
+    obstacles_column = obstacles_column_type(nrows, params.nx);
+  }
+
+  MPI_Gatherv(MPI_BOTTOM, ncols, child_cells_column,
+              MPI_BOTTOM, counts, displs, cells_column, 0, decomp->comm);
+  MPI_Gatherv(&child_obstacles[offset], ncols, child_obstacles_column,
+              band_obstacles, counts, displs, obstacles_column, 0, decomp->comm);
+
+  if(rank == 0) {
+    MPI_Type_free(&cells_column);
+    MPI_Type_free(&obstacles_column);
+    free(counts);
+    free(displs);
+  }
+  MPI_Type_free(&child_cells_column);
+  MPI_Type_free(&child_obstacles_column);
+}
+
+/*
+** Deep halos come from the direct neighbours only, so every block must be at
+** least HALO_DEPTH cells wide, and a block with its halo rows must not wrap
+** onto itself or it would hold the accelerated row twice. A single row of
+** processes always does, its halo rows are its own, so accelerate_cols()
+** steps over every copy. Only the synchronous pull step recomputes halo cells.
+*/
+void check_halo_depth(const t_decomp* decomp, const t_param params)
+{
+  if(HALO_DEPTH < 1) die("HALO_DEPTH must be at least 1", __LINE__, __FILE__);
+  //a single step per exchange leaves the tiles nothing to keep in cache
+  if(TEMPORAL_BLOCKING && HALO_DEPTH == 1) die("temporal blocking needs HALO_DEPTH > 1", __LINE__, __FILE__);
+  if(HALO_DEPTH == 1) return;
+  if(AA_PATTERN || ASYNC_HALOS) die("deep halos need the synchronous pull step", __LINE__, __FILE__);
+  if(TEMPORAL_BLOCKING && CHECKPOINT_EVERY % HALO_DEPTH != 0) {
+    die("temporal blocking needs CHECKPOINT_EVERY to be a multiple of HALO_DEPTH", __LINE__, __FILE__);
+  }
+  if(TEMPORAL_BLOCKING && TILE_ROWS < 2*HALO_DEPTH) {
+    die("temporal blocking needs tiles of at least 2*HALO_DEPTH rows", __LINE__, __FILE__);
+  }
+  for(int ii = 0; ii < decomp->dims[0]; ++ii) {
+    if(decomp->col_splits[ii + 1] - decomp->col_splits[ii] < HALO_DEPTH) {
+      die("a block has fewer cols than HALO_DEPTH", __LINE__, __FILE__);
+    }
+  }
+  if(decomp->dims[1] == 1) return;
+  for(int jj = 0; jj < decomp->dims[1]; ++jj) {
+    int nrows = decomp->row_splits[jj + 1] - decomp->row_splits[jj];
+    if(nrows < HALO_DEPTH || nrows + 2*HALO_DEPTH > params.ny) {
+      die("HALO_DEPTH doesn't fit the block rows", __LINE__, __FILE__);
+    }
+  }
+}
+
+/*
+** Split n weighted cols (or rows) into parts contiguous ranges of about equal
+** total weight. splits[i] is the first index of range i, splits[parts] = n.
+** Every range gets at least one index.
+*/
+void balanced_splits(const double* weights, int n, int parts, int* splits)
+{
+  double total = 0.0;
+  for(int i = 0; i < n; ++i) {
+    total += weights[i];
+  }
+
+  splits[0] = 0;
+  splits[parts] = n;
+  double prefix = 0.0;  /* weight of indices [0, i) */
+  int i = 0;
+  for(int part = 1; part < parts; ++part) {
+    double target = total * part / parts;
+    //split at the boundary closest to the target
+    while(i < n && prefix + 0.5 * weights[i] < target) {
+      prefix += weights[i++];
+    }
+    int lo = splits[part - 1] + 1;
+    int hi = n - (parts - part);
+    while(i < lo) prefix += weights[i++];
+    while(i > hi) prefix -= weights[--i];
+    splits[part] = i;
+  }
+}
+
+/* count blocked cells per col and per row, without holding the obstacle map */
+void count_obstacles(const char* obstaclefile, const t_param params, int* col_obstacles, int* row_obstacles)
+{
+  char   message[1024];  /* message buffer */
+  FILE*   fp;            /* file pointer */
+  int    xx, yy;         /* generic array indices */
+  int    blocked;        /* indicates whether a cell is blocked by an obstacle */
+  int    retval;         /* to hold return value for checking */
+
+  fp = fopen(obstaclefile, "r");
+
+  if (fp == NULL)
+  {
+    sprintf(message, "could not open input obstacles file: %s", obstaclefile);
+    die(message, __LINE__, __FILE__);
+  }
+
+  while ((retval = fscanf(fp, "%d %d %d\n", &xx, &yy, &blocked)) != EOF)
+  {
+    if (retval != 3) die("expected 3 values per line in obstacle file", __LINE__, __FILE__);
+
+    if (xx < 0 || xx > params.nx - 1) die("obstacle x-coord out of range", __LINE__, __FILE__);
+
+    if (yy < 0 || yy > params.ny - 1) die("obstacle y-coord out of range", __LINE__, __FILE__);
+
+    ++col_obstacles[xx];
+    ++row_obstacles[yy];
+  }
+
+  fclose(fp);
+}
+
+/*
+** Time the kernels of the configured timestep mode on an all-fluid and an
+** all-obstacle lattice, and return the cost of an obstacle cell relative to a
+** fluid cell. The scalar kernels skip the collision for obstacles, the SIMD
+** ones do the same work for both. Every rep times both lattices back to back
+** and the median of their ratios is rounded to OBSTACLE_COST_STEP, so noise
+** on a busy node doesn't move the splits from one run to the next.
+*/
+float measure_obstacle_cost(const t_param params)
+{
+  const int reps = 31;
+  t_param bench = params;
+  bench.nx = 256;
+  bench.ny = 64;
+  bench.pitch = row_pitch(bench.nx, ROW_PADDING);
+  bench.accel_row = -1;
+  bench.halo_cols = 1;
+  bench.halo_rows = 1;
+  t_speed_arrays* lattices[2][2];  /* fluid and obstacle lattice, each with its tmp */
+  unsigned char* obstacles[2];
+  double ratios[reps];
+
+  for(int blocked = 0; blocked < 2; ++blocked) {
+    lattices[blocked][0] = create_t_speed_arrays(bench);
+    lattices[blocked][1] = create_t_speed_arrays(bench);
+    obstacles[blocked] = (unsigned char*) calloc(bench.pitch * bench.ny, sizeof(unsigned char));
+    for(int ii = 0; ii < bench.pitch * bench.ny; ++ii) {
+      obstacles[blocked][ii] = blocked;
+      lattices[blocked][0]->speeds[0][ii] = params.density * 4.f / 9.f;
+      for(int kk = 1; kk < NSPEEDS; ++kk) {
+        lattices[blocked][0]->speeds[kk][ii] = params.density / ((kk < 5) ? 9.f : 36.f);
+      }
+    }
+  }
+
+  for(int rep = -1; rep < reps; ++rep) {
+    double timings[2];
+    for(int blocked = 0; blocked < 2; ++blocked) {
+      t_speed_arrays* cells = lattices[blocked][0];
+      t_speed_arrays* tmp_cells = lattices[blocked][1];
+      double tic = MPI_Wtime();
+      if(AA_PATTERN) {
+        aa_even_step(bench, cells, obstacles[blocked]);
+        aa_odd_step(bench, cells, obstacles[blocked]);
+      } else {
+        merged_timestep_ops(bench, cells, tmp_cells, obstacles[blocked], 2);
+        merged_timestep_ops(bench, tmp_cells, cells, obstacles[blocked], 2);
+      }
+      timings[blocked] = MPI_Wtime() - tic;
+    }
+    if(rep >= 0) ratios[rep] = timings[1] / timings[0];  // first rep is a warm up
+  }
+
+  for(int blocked = 0; blocked < 2; ++blocked) {
+    free_t_speed_arrays(lattices[blocked][0]);
+    free_t_speed_arrays(lattices[blocked][1]);
+    free(obstacles[blocked]);
+  }
+
+  //insertion sort, for the median
+  for(int ii = 1; ii < reps; ++ii) {
+    double ratio = ratios[ii];
+    int jj = ii;
+    for(; jj > 0 && ratios[jj - 1] > ratio; --jj) {
+      ratios[jj] = ratios[jj - 1];
+    }
+    ratios[jj] = ratio;
+  }
+  //never below one step, an obstacle still costs its rebound
+  float steps = roundf(ratios[reps / 2] / OBSTACLE_COST_STEP);
+  return ((steps < 1.f) ? 1.f : steps) * OBSTACLE_COST_STEP;
+}
+
+/*
+** Cost of an obstacle cell relative to a fluid cell for the selected
+** kernels, from the median of measure_obstacle_cost() on a quiet node,
+** rounded. Fixed, so the splits are the same from run to run; the scalar
+** kernels only rebound obstacles, the SIMD ones collide them too and blend
+** the result away, and the AA step leaves them alone.
+*/
+float default_obstacle_cost(void)
+{
+  if(AA_PATTERN) return OBSTACLE_COST_STEP;
+  if(merged_row_kernel == merged_row_ops) return 2*OBSTACLE_COST_STEP;
+  return 6*OBSTACLE_COST_STEP;
+}
+
+/* gather the predicted and the measured compute load of every rank on the master and print them */
+void report_imbalance(const t_decomp* decomp, const t_param child_params, unsigned char* child_obstacles, double compute_time)
+{
+  int rank, size;
+  MPI_Comm_rank(decomp->comm, &rank);
+  MPI_Comm_size(decomp->comm, &size);
+
+  int blocked = 0;
+  for(int jj = child_params.halo_rows; jj < child_params.ny - child_params.halo_rows; ++jj) {
+    for(int ii = child_params.halo_cols; ii < child_params.nx - child_params.halo_cols; ++ii) {
+      blocked += (child_obstacles[ii + jj*child_params.pitch] != 0);
+    }
+  }
+  double load[2];
+  load[0] = (decomp->ncols * decomp->nrows - blocked) + decomp->obstacle_cost * blocked;  /* predicted */
+  load[1] = compute_time;                                                               /* measured */
+
+  double* loads = NULL;
+  if(rank == 0) loads = (double*) malloc(2 * size * sizeof(double));
+  MPI_Gather(load, 2, MPI_DOUBLE, loads, 2, MPI_DOUBLE, 0, decomp->comm);
+
+  if(rank == 0) {
+    double mean[2] = {0.0, 0.0};
+    double max[2] = {0.0, 0.0};
+    for(int process = 0; process < size; ++process) {
+      for(int i = 0; i < 2; ++i) {
+        mean[i] += loads[2*process + i] / size;
+        if(loads[2*process + i] > max[i]) max[i] = loads[2*process + i];
+      }
+    }
+    printf("Load per rank (relative to mean):\n");
+    printf("rank\tcols\trows\tpredicted\tmeasured\n");
+    for(int process = 0; process < size; ++process) {
+      int start_col, ncols, start_row, nrows;
+      decomp_block(decomp, process, &start_col, &ncols, &start_row, &nrows);
+      printf("%d\t%d\t%d\t%.3f\t\t%.3f\n", process, ncols, nrows,
+             loads[2*process] / mean[0], (mean[1] > 0.0) ? loads[2*process + 1] / mean[1] : 0.0);
+    }
+    printf("Imbalance (max/mean):\tpredicted %.3f\tmeasured %.3f\n",
+           max[0] / mean[0], (mean[1] > 0.0) ? max[1] / mean[1] : 0.0);
+    free(loads);
+  }
+}
+
+void initialise_params_from_file(const char* paramfile, t_param* params) {
+  char   message[1024];  /* message buffer */
+  int    retval;         /* to hold return value for checking */
+  FILE* fp;
+
+  /* open the parameter file */
+  fp = fopen(paramfile, "r");
+
+  if (fp == NULL)
+  {
+    sprintf(message, "could not open input parameter file: %s", paramfile);
+    die(message, __LINE__, __FILE__);
+  }
+
+  /* read in the parameter values */
+  retval = fscanf(fp, "%d\n", &(params->nx));
+
+  if (retval != 1) die("could not read param file: nx", __LINE__, __FILE__);
+
+  retval = fscanf(fp, "%d\n", &(params->ny));
+
+  if (retval != 1) die("could not read param file: ny", __LINE__, __FILE__);
 
   retval = fscanf(fp, "%d\n", &(params->maxIters));
 
@@ -771,11 +3222,17 @@ void initialise_params_from_file(const char* paramfile, t_param* params) {
 
   if (retval != 1) die("could not read param file: omega", __LINE__, __FILE__);
 
+  params->accel_row = params->ny - 2;
+  params->accel_stride = params->ny;
+  params->halo_cols = 0;
+  params->halo_rows = 0;
+  params->pitch = params->nx;
+
   /* and close up the file */
   fclose(fp);
 }
 
-int timestep(const t_param params, t_speed_arrays** cells, t_speed_arrays** tmp_cells, int* obstacles, int flag)
+int timestep(const t_param params, t_speed_arrays** cells, t_speed_arrays** tmp_cells, unsigned char* obstacles, int flag)
 {
   accelerate_flow(params, *cells, obstacles, flag);
 
@@ -783,93 +3240,21 @@ int timestep(const t_param params, t_speed_arrays** cells, t_speed_arrays** tmp_
   rebound(params, *cells, *tmp_cells, obstacles, flag);
   collision(params, *cells, *tmp_cells, obstacles, flag);
 
-  //printf("ALBADASKFEWF\n");
-  //printf("flag: %d\n", flag);
-
-  //merged_timestep_ops(params, *cells, *tmp_cells, obstacles, flag);
-  //t_speed *cells_ptr = *cells;
-  //*cells = *tmp_cells;
-  //*tmp_cells = cells_ptr;
-
-  return EXIT_SUCCESS;
-}
-
-float timestep_async(const t_param params, t_speed_arrays** cells, t_speed_arrays** tmp_cells, int* obstacles, int flag, t_speed_arrays *tmp_cells2, int total_requests, MPI_Request **requests)
-{
-  float res = -1;
-  if(flag == 0) {
-    accelerate_flow(params, *cells, obstacles, 0);
-
-    if(MERGE_TIMESTEP) {
-      res = merged_timestep_ops(params, *cells, *tmp_cells, obstacles, 0);
-      t_speed_arrays *cells_ptr = *cells;
-      *cells = *tmp_cells;
-      *tmp_cells = cells_ptr;
-    } else {
-
-      //retain cols 2 and params.nx-3
-      for(int i = 0; i < params.ny; ++i) {
-        for(int kk = 0; kk < NSPEEDS; ++kk) {
-          tmp_cells2->speeds[kk][i] = (*cells)->speeds[kk][i*params.nx + 2];
-          tmp_cells2->speeds[kk][params.ny + i] = (*cells)->speeds[kk][i*params.nx + (params.nx - 3)];
-        }
-      }
-
-      propagate(params, *cells, *tmp_cells, 0);
-      rebound(params, *cells, *tmp_cells, obstacles, 0);
-      collision(params, *cells, *tmp_cells, obstacles, 0);
-    }
-  } else if(flag == 1) {
-
-    if(MERGE_TIMESTEP) {
-      accelerate_flow(params, *tmp_cells, obstacles, 1);
-      res = merged_timestep_ops(params, *tmp_cells, *cells, obstacles, 1);
-
-    } else {
-      //swap vals
-      for(int i = 0; i < params.ny; ++i) {
-        swap_cells_arrays(tmp_cells2, *cells, i, i*params.nx + 2);
-        swap_cells_arrays(tmp_cells2, *cells, params.ny + i, i*params.nx + (params.nx - 3));
-      }
+  //printf("ALBADASKFEWF\n");
+  //printf("flag: %d\n", flag);
 
-      accelerate_flow(params, *cells, obstacles, 1);
-      propagate(params, *cells, *tmp_cells, 1);
-      //MPI implementations are lazy, so check for status to encourage exchange
-      for(int i = 0; i < total_requests; ++i) {
-          int res = 0;
-          MPI_Test(requests[i], &res, MPI_STATUS_IGNORE);
-      }
-      rebound(params, *cells, *tmp_cells, obstacles, 1);
-      collision(params, *cells, *tmp_cells, obstacles, 1);
-      for(int i = 0; i < params.ny; ++i) {
-        for(int kk = 0; kk < NSPEEDS; ++kk) {
-          (*cells)->speeds[kk][i*params.nx + 2] = tmp_cells2->speeds[kk][i];
-          (*cells)->speeds[kk][i*params.nx + (params.nx - 3)] = tmp_cells2->speeds[kk][params.ny + i];
-        }
-      }
-    }
+  //merged_timestep_ops(params, *cells, *tmp_cells, obstacles, flag);
+  //t_speed *cells_ptr = *cells;
+  //*cells = *tmp_cells;
+  //*tmp_cells = cells_ptr;
 
-  } else {
-    accelerate_flow(params, *cells, obstacles, flag);
-    res = merged_timestep_ops(params, *cells, *tmp_cells, obstacles, flag);
-    t_speed_arrays *cells_ptr = *cells;
-    *cells = *tmp_cells;
-    *tmp_cells = cells_ptr;
-    //propagate(params, cells, tmp_cells, flag);
-    //rebound(params, cells, tmp_cells, obstacles, flag);
-    //collision(params, cells, tmp_cells, obstacles, flag);
-  }
-  return res;
+  return EXIT_SUCCESS;
 }
 
-int accelerate_flow(const t_param params, t_speed_arrays* cells, int* obstacles, int flag)
+int accelerate_flow(const t_param params, t_speed_arrays* cells, unsigned char* obstacles, int flag)
 {
-  /* compute weighting factors */
-  float w1 = params.density * params.accel / 9.f;
-  float w2 = params.density * params.accel / 36.f;
-
   /* modify the 2nd row of the grid */
-  int jj = params.ny - 2;
+  if(params.accel_row < 0) return EXIT_SUCCESS;
 
   int start, end, increment;
   if(flag == 0) {
@@ -889,28 +3274,44 @@ int accelerate_flow(const t_param params, t_speed_arrays* cells, int* obstacles,
     end = params.nx;
     increment = 1;
   }
+  accelerate_cols(params, cells, obstacles, 0, params.ny, start, end, increment);
+
+  return EXIT_SUCCESS;
+}
+
+/* accelerate cols [start, end) of the copies of the accelerated row within rows [row_start, row_end) */
+void accelerate_cols(const t_param params, t_speed_arrays* cells, unsigned char* obstacles, int row_start, int row_end,
+                     int start, int end, int increment)
+{
+  /* compute weighting factors */
+  float w1 = params.density * params.accel / 9.f;
+  float w2 = params.density * params.accel / 36.f;
 
-  for (int ii = start; ii < end; ii += increment)
+  if(params.accel_row < 0) return;
+  for (int jj = params.accel_row; jj < row_end; jj += params.accel_stride)
   {
-    /* if the cell is not occupied and
-    ** we don't send a negative density */
-    if (!obstacles[ii + jj*params.nx]
-        && (cells->speeds[3][ii + jj*params.nx] - w1) > 0.f
-        && (cells->speeds[6][ii + jj*params.nx] - w2) > 0.f
-        && (cells->speeds[7][ii + jj*params.nx] - w2) > 0.f)
+    if(jj < row_start) continue;
+    #pragma omp parallel for schedule(static)
+    for (int ii = start; ii < end; ii += increment)
     {
-      /* increase 'east-side' densities */
-      cells->speeds[1][ii + jj*params.nx] += w1;
-      cells->speeds[5][ii + jj*params.nx] += w2;
-      cells->speeds[8][ii + jj*params.nx] += w2;
-      /* decrease 'west-side' densities */
-      cells->speeds[3][ii + jj*params.nx] -= w1;
-      cells->speeds[6][ii + jj*params.nx] -= w2;
-      cells->speeds[7][ii + jj*params.nx] -= w2;
+      /* if the cell is not occupied and
+      ** we don't send a negative density */
+      if (!obstacles[ii + jj*params.pitch]
+          && (cells->speeds[3][ii + jj*params.pitch] - w1) > 0.f
+          && (cells->speeds[6][ii + jj*params.pitch] - w2) > 0.f
+          && (cells->speeds[7][ii + jj*params.pitch] - w2) > 0.f)
+      {
+        /* increase 'east-side' densities */
+        cells->speeds[1][ii + jj*params.pitch] += w1;
+        cells->speeds[5][ii + jj*params.pitch] += w2;
+        cells->speeds[8][ii + jj*params.pitch] += w2;
+        /* decrease 'west-side' densities */
+        cells->speeds[3][ii + jj*params.pitch] -= w1;
+        cells->speeds[6][ii + jj*params.pitch] -= w2;
+        cells->speeds[7][ii + jj*params.pitch] -= w2;
+      }
     }
   }
-
-  return EXIT_SUCCESS;
 }
 
 int propagate(const t_param params, t_speed_arrays* cells, t_speed_arrays* tmp_cells, int flag)
@@ -946,99 +3347,211 @@ int propagate(const t_param params, t_speed_arrays* cells, t_speed_arrays* tmp_c
       /* propagate densities from neighbouring cells, following
       ** appropriate directions of travel and writing into
       ** scratch space grid */
-      tmp_cells->speeds[0][ii + jj*params.nx] = cells->speeds[0][ii + jj*params.nx]; /* central cell, no movement */
-      tmp_cells->speeds[1][ii + jj*params.nx] = cells->speeds[1][x_w + jj*params.nx]; /* east */
-      tmp_cells->speeds[2][ii + jj*params.nx] = cells->speeds[2][ii + y_s*params.nx]; /* north */
-      tmp_cells->speeds[3][ii + jj*params.nx] = cells->speeds[3][x_e + jj*params.nx]; /* west */
-      tmp_cells->speeds[4][ii + jj*params.nx] = cells->speeds[4][ii + y_n*params.nx]; /* south */
-      tmp_cells->speeds[5][ii + jj*params.nx] = cells->speeds[5][x_w + y_s*params.nx]; /* north-east */
-      tmp_cells->speeds[6][ii + jj*params.nx] = cells->speeds[6][x_e + y_s*params.nx]; /* north-west */
-      tmp_cells->speeds[7][ii + jj*params.nx] = cells->speeds[7][x_e + y_n*params.nx]; /* south-west */
-      tmp_cells->speeds[8][ii + jj*params.nx] = cells->speeds[8][x_w + y_n*params.nx]; /* south-east */
+      tmp_cells->speeds[0][ii + jj*params.pitch] = cells->speeds[0][ii + jj*params.pitch]; /* central cell, no movement */
+      tmp_cells->speeds[1][ii + jj*params.pitch] = cells->speeds[1][x_w + jj*params.pitch]; /* east */
+      tmp_cells->speeds[2][ii + jj*params.pitch] = cells->speeds[2][ii + y_s*params.pitch]; /* north */
+      tmp_cells->speeds[3][ii + jj*params.pitch] = cells->speeds[3][x_e + jj*params.pitch]; /* west */
+      tmp_cells->speeds[4][ii + jj*params.pitch] = cells->speeds[4][ii + y_n*params.pitch]; /* south */
+      tmp_cells->speeds[5][ii + jj*params.pitch] = cells->speeds[5][x_w + y_s*params.pitch]; /* north-east */
+      tmp_cells->speeds[6][ii + jj*params.pitch] = cells->speeds[6][x_e + y_s*params.pitch]; /* north-west */
+      tmp_cells->speeds[7][ii + jj*params.pitch] = cells->speeds[7][x_e + y_n*params.pitch]; /* south-west */
+      tmp_cells->speeds[8][ii + jj*params.pitch] = cells->speeds[8][x_w + y_n*params.pitch]; /* south-east */
     }
   }
 
   return EXIT_SUCCESS;
 }
 
-float merged_timestep_ops(const t_param params, t_speed_arrays*restrict cells, t_speed_arrays*restrict tmp_cells, int*restrict obstacles, int flag) {
+/*
+** One merged timestep of cells into tmp_cells with the halo exchange in flight:
+** the cells that don't read a halo go first, in chunks of rows with a poll of
+** the requests in between to keep the exchange progressing, then the cells
+** next to the halos once it completes. Same results as exchange_halos()
+** followed by merged_timestep_ops(). Returns the time spent waiting.
+*/
+double timestep_overlapped(const t_decomp* decomp, const t_param params, t_speed_arrays* cells,
+                           t_speed_arrays* tmp_cells, unsigned char* obstacles)
+{
+  const int chunks = 8;   /* polls of the exchange while computing the interior */
+  const t_halo_types* halo = start_halos(decomp, params, cells);
+
+  //rows next to the halo rows wait for the exchange
+  int row_start = 2;
+  int row_end = params.ny - 2;
+  int chunk_rows = (row_end - row_start + chunks - 1) / chunks;
+  for(int jj = row_start; jj < row_end; jj += chunk_rows) {
+    merged_block_ops(params, cells, tmp_cells, obstacles, jj, min(jj + chunk_rows, row_end), 2, params.nx - 2);
+    int done;
+    MPI_Testall(halo->nrequests, (MPI_Request*) halo->requests, &done, MPI_STATUSES_IGNORE);
+  }
+
+  double wait_tic = MPI_Wtime();
+  MPI_Waitall(halo->nrequests, (MPI_Request*) halo->requests, MPI_STATUSES_IGNORE);
+  double wait_time = MPI_Wtime() - wait_tic;
+
+  //cols next to the halo cols, then what is left of the rows next to the halo rows
+  merged_block_ops(params, cells, tmp_cells, obstacles, params.halo_rows, params.ny - params.halo_rows, 1, 2);
+  if(params.nx - 2 > 1) {
+    merged_block_ops(params, cells, tmp_cells, obstacles, params.halo_rows, params.ny - params.halo_rows,
+                     params.nx - 2, params.nx - 1);
+  }
+  merged_block_ops(params, cells, tmp_cells, obstacles, 1, 2, 2, params.nx - 2);
+  if(params.ny - 2 > 1) {
+    merged_block_ops(params, cells, tmp_cells, obstacles, params.ny - 2, params.ny - 1, 2, params.nx - 2);
+  }
+
+  return wait_time;
+}
+
+/*
+** All HALO_DEPTH steps between two halo exchanges, as a wavefront over tiles
+** of TILE_ROWS rows instead of a full sweep of the lattice per step. Every
+** tile goes through all steps while it is in cache, moving one row down per
+** step, so it reads only rows that the tiles before it have finished and
+** overwrites only rows no later step still needs. The cells see the same
+** operations in the same order as in the step by step loop. Expects accelerated cells with fresh
+** halos, leaves the last step in *cells and the summed velocities of the
+** owned cells after each step in vels.
+*/
+void timestep_blocked(const t_param params, t_speed_arrays** cells, t_speed_arrays** tmp_cells, unsigned char* obstacles,
+                      float* vels)
+{
+  int steps = params.halo_cols;
+  t_speed_arrays* lattices[2] = {*cells, *tmp_cells};  /* step s reads lattices[(s - 1) % 2] */
+  int first = 1;  /* rows [first, last) are swept */
+  int last = params.ny - first;
+  int ntiles = (last - first + TILE_ROWS - 1) / TILE_ROWS;
+
+  for(int s = 0; s < steps; ++s) vels[s] = 0.f;
+  for(int tile = 0; tile < ntiles; ++tile) {
+    int tile_start = first + tile*TILE_ROWS;
+    int tile_end = (tile == ntiles - 1) ? last : tile_start + TILE_ROWS;
+    for(int s = 1; s <= steps; ++s) {
+      //step s is valid at least s rows away from the edge of the lattice
+      int start = max(tile_start - (s - 1), s);
+      int end = min(tile_end - (s - 1), params.ny - s);
+      timestep_blocked_rows(params, lattices, obstacles, s, start, end, vels);
+    }
+  }
+  *cells = lattices[steps % 2];
+  *tmp_cells = lattices[(steps + 1) % 2];
+}
+
+/* step of timestep_blocked() over rows [start, end), cols that are valid after it */
+void timestep_blocked_rows(const t_param params, t_speed_arrays** lattices, unsigned char* obstacles, int step,
+                           int start, int end, float* vels)
+{
+  if(end <= start) return;
+  t_speed_arrays* from = lattices[(step - 1) % 2];
+  t_speed_arrays* to = lattices[step % 2];
+  merged_block_ops(params, from, to, obstacles, start, end, step, params.nx - step);
+  vels[step - 1] += av_velocity_block(params, to, obstacles, max(start, params.halo_rows),
+                                      min(end, params.ny - params.halo_rows),
+                                      params.halo_cols, params.nx - params.halo_cols, 1);
+  //the next step reads these rows accelerated, the last step is accelerated by the caller
+  if(step < params.halo_cols) {
+    accelerate_cols(params, to, obstacles, start, end, step, params.nx - step, 1);
+  }
+}
+
+/* merged propagate/rebound/collision/av_velocity over rows [row_start, row_end) and cols [col_start, col_end) */
+float merged_block_ops(const t_param params, t_speed_arrays* cells, t_speed_arrays* tmp_cells, unsigned char* obstacles,
+                       int row_start, int row_end, int col_start, int col_end) {
+  float tot_u = 0.f;         /* accumulated magnitudes of velocity for each cell */
+  if(col_end <= col_start) return tot_u;
+  #pragma omp parallel for schedule(static) reduction(+:tot_u)
+  for (int jj = row_start; jj < row_end; jj++)
+  {
+    tot_u += merged_row_kernel(params, cells, tmp_cells, obstacles, jj, col_start, col_end);
+  }
+
+  return tot_u;
+}
+
+float merged_timestep_ops(const t_param params, t_speed_arrays*restrict cells, t_speed_arrays*restrict tmp_cells, unsigned char*restrict obstacles, int flag) {
   // merge propagate, rebound, collision and av_velocity
-  int start, end, increment;
+  int start, end;
   if(flag == 0) {
     start = 2;
     end = params.nx-2;
-    increment = 1;
-  } else if(flag == 1) {
-    start = 0;
-    end = params.nx;
-    increment = 1;
   } else {
-    start = 0;
-    end = params.nx;
-    increment = 1;
+    start = 1;
+    end = params.nx-1;
+  }
+
+  float tot_u = 0.f;         /* accumulated magnitudes of velocity for each cell */
+  /* loop over the owned cells, the halos are refreshed before every step anyway */
+  #pragma omp parallel for schedule(static) reduction(+:tot_u)
+  for (int jj = params.halo_rows; jj < params.ny - params.halo_rows; jj++)
+  {
+    if(flag == 1) {
+      //only the col next to each halo
+      tot_u += merged_row_kernel(params, cells, tmp_cells, obstacles, jj, 1, 2);
+      tot_u += merged_row_kernel(params, cells, tmp_cells, obstacles, jj, params.nx - 2, params.nx - 1);
+    } else {
+      tot_u += merged_row_kernel(params, cells, tmp_cells, obstacles, jj, start, end);
+    }
   }
 
+  return tot_u;
+}
+
+float merged_row_ops(const t_param params, t_speed_arrays*restrict cells, t_speed_arrays*restrict tmp_cells,
+                     unsigned char*restrict obstacles, int jj, int start, int end) {
   const float c_sq = 1.f / 3.f; /* square of speed of sound */
   const float w0 = 4.f / 9.f;  /* weighting factor */
   const float w1 = 1.f / 9.f;  /* weighting factor */
   const float w2 = 1.f / 36.f; /* weighting factor */
   float tot_u = 0.f;         /* accumulated magnitudes of velocity for each cell */
-  /* loop over _all_ cells */
-  for (int jj = 0; jj < params.ny; jj++)
+  for (int ii = start; ii < end; ++ii)
   {
-    for (int ii = start; ii < end; ii += increment)
-    {
-      if(flag == 1 && ii == 2) {
-        ii = params.nx - 2;
-      }
-
       /*
-      t_speed currentVal = cells[jj*params.nx + ii];
+      t_speed currentVal = cells[jj*params.pitch + ii];
       printf("BEFORE: speed1: %d, speed2: %d, speed6: %d\n", currentVal.speed[1],
                                       currentVal.speed[2], currentVal.speed[6]);
       */
 
       // PROPAGATE STUFF
-      /* determine indices of axis-direction neighbours
-      ** respecting periodic boundary conditions (wrap around) */
-      int y_n = (jj + 1) % params.ny;
-      int x_e = (ii + 1) % params.nx;
-      int y_s = (jj == 0) ? (jj + params.ny - 1) : (jj - 1);
-      int x_w = (ii == 0) ? (ii + params.nx - 1) : (ii - 1);
+      /* determine indices of axis-direction neighbours, the halo
+      ** cols and rows hold the periodic wrap around */
+      int y_n = jj + 1;
+      int x_e = ii + 1;
+      int y_s = jj - 1;
+      int x_w = ii - 1;
       /* propagate densities from neighbouring cells, following
       ** appropriate directions of travel and writing into
       ** scratch space grid */
-      tmp_cells->speeds[0][ii + jj*params.nx] = cells->speeds[0][ii + jj*params.nx]; /* central cell, no movement */
-      tmp_cells->speeds[1][ii + jj*params.nx] = cells->speeds[1][x_w + jj*params.nx]; /* east */
-      tmp_cells->speeds[2][ii + jj*params.nx] = cells->speeds[2][ii + y_s*params.nx]; /* north */
-      tmp_cells->speeds[3][ii + jj*params.nx] = cells->speeds[3][x_e + jj*params.nx]; /* west */
-      tmp_cells->speeds[4][ii + jj*params.nx] = cells->speeds[4][ii + y_n*params.nx]; /* south */
-      tmp_cells->speeds[5][ii + jj*params.nx] = cells->speeds[5][x_w + y_s*params.nx]; /* north-east */
-      tmp_cells->speeds[6][ii + jj*params.nx] = cells->speeds[6][x_e + y_s*params.nx]; /* north-west */
-      tmp_cells->speeds[7][ii + jj*params.nx] = cells->speeds[7][x_e + y_n*params.nx]; /* south-west */
-      tmp_cells->speeds[8][ii + jj*params.nx] = cells->speeds[8][x_w + y_n*params.nx]; /* south-east */
+      tmp_cells->speeds[0][ii + jj*params.pitch] = cells->speeds[0][ii + jj*params.pitch]; /* central cell, no movement */
+      tmp_cells->speeds[1][ii + jj*params.pitch] = cells->speeds[1][x_w + jj*params.pitch]; /* east */
+      tmp_cells->speeds[2][ii + jj*params.pitch] = cells->speeds[2][ii + y_s*params.pitch]; /* north */
+      tmp_cells->speeds[3][ii + jj*params.pitch] = cells->speeds[3][x_e + jj*params.pitch]; /* west */
+      tmp_cells->speeds[4][ii + jj*params.pitch] = cells->speeds[4][ii + y_n*params.pitch]; /* south */
+      tmp_cells->speeds[5][ii + jj*params.pitch] = cells->speeds[5][x_w + y_s*params.pitch]; /* north-east */
+      tmp_cells->speeds[6][ii + jj*params.pitch] = cells->speeds[6][x_e + y_s*params.pitch]; /* north-west */
+      tmp_cells->speeds[7][ii + jj*params.pitch] = cells->speeds[7][x_e + y_n*params.pitch]; /* south-west */
+      tmp_cells->speeds[8][ii + jj*params.pitch] = cells->speeds[8][x_w + y_n*params.pitch]; /* south-east */
 
       // PROPAGATION DONE
 
       // REBOUND STUFF
       /* if the cell contains an obstacle */
-      if (obstacles[jj*params.nx + ii])
+      if (obstacles[jj*params.pitch + ii])
       {
         /* called after propagate, so taking values from scratch space
         ** mirroring, and writing into main grid */
-        //t_speed current_cell = tmp_cells[ii + jj*params.nx];
+        //t_speed current_cell = tmp_cells[ii + jj*params.pitch];
         float current_cell[NSPEEDS];
         for(int kk = 0; kk < NSPEEDS; ++kk) {
-          current_cell[kk] = tmp_cells->speeds[kk][ii + jj*params.nx];
+          current_cell[kk] = tmp_cells->speeds[kk][ii + jj*params.pitch];
         }
-        tmp_cells->speeds[1][ii + jj*params.nx] = current_cell[3];
-        tmp_cells->speeds[2][ii + jj*params.nx] = current_cell[4];
-        tmp_cells->speeds[3][ii + jj*params.nx] = current_cell[1];
-        tmp_cells->speeds[4][ii + jj*params.nx] = current_cell[2];
-        tmp_cells->speeds[5][ii + jj*params.nx] = current_cell[7];
-        tmp_cells->speeds[6][ii + jj*params.nx] = current_cell[8];
-        tmp_cells->speeds[7][ii + jj*params.nx] = current_cell[5];
-        tmp_cells->speeds[8][ii + jj*params.nx] = current_cell[6];
+        tmp_cells->speeds[1][ii + jj*params.pitch] = current_cell[3];
+        tmp_cells->speeds[2][ii + jj*params.pitch] = current_cell[4];
+        tmp_cells->speeds[3][ii + jj*params.pitch] = current_cell[1];
+        tmp_cells->speeds[4][ii + jj*params.pitch] = current_cell[2];
+        tmp_cells->speeds[5][ii + jj*params.pitch] = current_cell[7];
+        tmp_cells->speeds[6][ii + jj*params.pitch] = current_cell[8];
+        tmp_cells->speeds[7][ii + jj*params.pitch] = current_cell[5];
+        tmp_cells->speeds[8][ii + jj*params.pitch] = current_cell[6];
       }
       // REBOUND DONE
 
@@ -1051,24 +3564,24 @@ float merged_timestep_ops(const t_param params, t_speed_arrays*restrict cells, t
 
         for (int kk = 0; kk < NSPEEDS; kk++)
         {
-          local_density += tmp_cells->speeds[kk][ii + jj*params.nx];
+          local_density += tmp_cells->speeds[kk][ii + jj*params.pitch];
         }
 
         /* compute x velocity component */
-        float u_x = (tmp_cells->speeds[1][ii + jj*params.nx]
-                      + tmp_cells->speeds[5][ii + jj*params.nx]
-                      + tmp_cells->speeds[8][ii + jj*params.nx]
-                      - (tmp_cells->speeds[3][ii + jj*params.nx]
-                         + tmp_cells->speeds[6][ii + jj*params.nx]
-                         + tmp_cells->speeds[7][ii + jj*params.nx]))
+        float u_x = (tmp_cells->speeds[1][ii + jj*params.pitch]
+                      + tmp_cells->speeds[5][ii + jj*params.pitch]
+                      + tmp_cells->speeds[8][ii + jj*params.pitch]
+                      - (tmp_cells->speeds[3][ii + jj*params.pitch]
+                         + tmp_cells->speeds[6][ii + jj*params.pitch]
+                         + tmp_cells->speeds[7][ii + jj*params.pitch]))
                      / local_density;
         /* compute y velocity component */
-        float u_y = (tmp_cells->speeds[2][ii + jj*params.nx]
-                      + tmp_cells->speeds[5][ii + jj*params.nx]
-                      + tmp_cells->speeds[6][ii + jj*params.nx]
-                      - (tmp_cells->speeds[4][ii + jj*params.nx]
-                         + tmp_cells->speeds[7][ii + jj*params.nx]
-                         + tmp_cells->speeds[8][ii + jj*params.nx]))
+        float u_y = (tmp_cells->speeds[2][ii + jj*params.pitch]
+                      + tmp_cells->speeds[5][ii + jj*params.pitch]
+                      + tmp_cells->speeds[6][ii + jj*params.pitch]
+                      - (tmp_cells->speeds[4][ii + jj*params.pitch]
+                         + tmp_cells->speeds[7][ii + jj*params.pitch]
+                         + tmp_cells->speeds[8][ii + jj*params.pitch]))
                      / local_density;
 
         /* velocity squared */
@@ -1117,52 +3630,752 @@ float merged_timestep_ops(const t_param params, t_speed_arrays*restrict cells, t
                                          + (u[8] * u[8]) / (2.f * c_sq * c_sq)
                                          - u_sq / (2.f * c_sq));
 
-        /* relaxation step */
-        for (int kk = 0; kk < NSPEEDS; kk++)
-        {
-          tmp_cells->speeds[kk][ii + jj*params.nx] = tmp_cells->speeds[kk][ii + jj*params.nx]
-                                                  + params.omega
-                                                  * (d_equ[kk] - tmp_cells->speeds[kk][ii + jj*params.nx]);
-        }
+        /* relaxation step */
+        for (int kk = 0; kk < NSPEEDS; kk++)
+        {
+          tmp_cells->speeds[kk][ii + jj*params.pitch] = tmp_cells->speeds[kk][ii + jj*params.pitch]
+                                                  + params.omega
+                                                  * (d_equ[kk] - tmp_cells->speeds[kk][ii + jj*params.pitch]);
+        }
+
+        //AV VELOCITY CODE
+        /* accumulate the norm of x- and y- velocity components */
+        if(ii != 0 && ii != params.nx-1) {
+          u_x = (tmp_cells->speeds[1][ii + jj*params.pitch]
+                        + tmp_cells->speeds[5][ii + jj*params.pitch]
+                        + tmp_cells->speeds[8][ii + jj*params.pitch]
+                        - (tmp_cells->speeds[3][ii + jj*params.pitch]
+                           + tmp_cells->speeds[6][ii + jj*params.pitch]
+                           + tmp_cells->speeds[7][ii + jj*params.pitch]))
+                       / local_density;
+          /* compute y velocity component */
+          u_y = (tmp_cells->speeds[2][ii + jj*params.pitch]
+                        + tmp_cells->speeds[5][ii + jj*params.pitch]
+                        + tmp_cells->speeds[6][ii + jj*params.pitch]
+                        - (tmp_cells->speeds[4][ii + jj*params.pitch]
+                           + tmp_cells->speeds[7][ii + jj*params.pitch]
+                           + tmp_cells->speeds[8][ii + jj*params.pitch]))
+                       / local_density;
+
+          tot_u += sqrtf((u_x * u_x) + (u_y * u_y));
+        }
+        //DONE AV_VELOCITY
+      }
+      // COLLISION DONE
+  }
+
+  return tot_u;
+}
+
+#if HAVE_X86_SIMD
+/*
+** Vectorised versions of merged_row_ops. Each iteration handles a full vector
+** of cells in the row, the row remainder goes through the scalar kernel. Both the rebound and the collision
+** result are computed for every lane and blended on the obstacle mask.
+** Arithmetic is done in the same order as the scalar kernel, so the results
+** are bit-identical to it.
+*/
+__attribute__((target("avx2")))
+float merged_row_ops_avx2(const t_param params, t_speed_arrays*restrict cells, t_speed_arrays*restrict tmp_cells,
+                          unsigned char*restrict obstacles, int jj, int start, int end) {
+  static const int opposite[NSPEEDS] = {0, 3, 4, 1, 2, 7, 8, 5, 6};
+  if(end - start < 8) {
+    return merged_row_ops(params, cells, tmp_cells, obstacles, jj, start, end);
+  }
+
+  const int row = jj*params.pitch;
+  const int row_n = row + params.pitch;
+  const int row_s = row - params.pitch;
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 one = _mm256_set1_ps(1.f);
+  const __m256 c_sq = _mm256_set1_ps(1.f / 3.f);                       /* square of speed of sound */
+  const __m256 two_c_sq = _mm256_set1_ps(2.f * (1.f / 3.f));
+  const __m256 two_c_sq_sq = _mm256_set1_ps(2.f * (1.f / 3.f) * (1.f / 3.f));
+  const __m256 w0 = _mm256_set1_ps(4.f / 9.f);
+  const __m256 w1 = _mm256_set1_ps(1.f / 9.f);
+  const __m256 w2 = _mm256_set1_ps(1.f / 36.f);
+  const __m256 omega = _mm256_set1_ps(params.omega);
+  __m256 acc = zero;
+
+  float tot_u = 0.f;
+  int ii = start;
+  for(; ii + 8 <= end; ii += 8) {
+    /* propagate */
+    __m256 f[NSPEEDS];
+    f[0] = _mm256_loadu_ps(&cells->speeds[0][ii + row]);
+    f[1] = _mm256_loadu_ps(&cells->speeds[1][ii - 1 + row]);
+    f[2] = _mm256_loadu_ps(&cells->speeds[2][ii + row_s]);
+    f[3] = _mm256_loadu_ps(&cells->speeds[3][ii + 1 + row]);
+    f[4] = _mm256_loadu_ps(&cells->speeds[4][ii + row_n]);
+    f[5] = _mm256_loadu_ps(&cells->speeds[5][ii - 1 + row_s]);
+    f[6] = _mm256_loadu_ps(&cells->speeds[6][ii + 1 + row_s]);
+    f[7] = _mm256_loadu_ps(&cells->speeds[7][ii + 1 + row_n]);
+    f[8] = _mm256_loadu_ps(&cells->speeds[8][ii - 1 + row_n]);
+
+    /* all bits set in lanes without an obstacle, widened from 8 mask bytes */
+    __m256i blocked = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*) &obstacles[ii + row]));
+    __m256 fluid = _mm256_castsi256_ps(_mm256_cmpeq_epi32(blocked, _mm256_setzero_si256()));
+
+    /* collision */
+    __m256 local_density = f[0];
+    for(int kk = 1; kk < NSPEEDS; ++kk) {
+      local_density = _mm256_add_ps(local_density, f[kk]);
+    }
+    __m256 u_x = _mm256_div_ps(_mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(f[1], f[5]), f[8]),
+                                             _mm256_add_ps(_mm256_add_ps(f[3], f[6]), f[7])), local_density);
+    __m256 u_y = _mm256_div_ps(_mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(f[2], f[5]), f[6]),
+                                             _mm256_add_ps(_mm256_add_ps(f[4], f[7]), f[8])), local_density);
+    __m256 u_sq_term = _mm256_div_ps(_mm256_add_ps(_mm256_mul_ps(u_x, u_x), _mm256_mul_ps(u_y, u_y)), two_c_sq);
+
+    __m256 u[NSPEEDS];
+    u[1] = u_x;
+    u[2] = u_y;
+    u[3] = _mm256_sub_ps(zero, u_x);
+    u[4] = _mm256_sub_ps(zero, u_y);
+    u[5] = _mm256_add_ps(u_x, u_y);
+    u[6] = _mm256_sub_ps(u_y, u_x);
+    u[7] = _mm256_sub_ps(zero, u[5]);
+    u[8] = _mm256_sub_ps(u_x, u_y);
+
+    __m256 w1_density = _mm256_mul_ps(w1, local_density);
+    __m256 w2_density = _mm256_mul_ps(w2, local_density);
+    __m256 d_equ[NSPEEDS];
+    d_equ[0] = _mm256_mul_ps(_mm256_mul_ps(w0, local_density), _mm256_sub_ps(one, u_sq_term));
+    for(int kk = 1; kk < NSPEEDS; ++kk) {
+      d_equ[kk] = _mm256_mul_ps((kk < 5) ? w1_density : w2_density,
+                                _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(one, _mm256_div_ps(u[kk], c_sq)),
+                                                            _mm256_div_ps(_mm256_mul_ps(u[kk], u[kk]), two_c_sq_sq)),
+                                              u_sq_term));
+    }
+
+    /* relaxation for fluid lanes, rebound for obstacle lanes */
+    __m256 out[NSPEEDS];
+    for(int kk = 0; kk < NSPEEDS; ++kk) {
+      __m256 relaxed = _mm256_add_ps(f[kk], _mm256_mul_ps(omega, _mm256_sub_ps(d_equ[kk], f[kk])));
+      out[kk] = _mm256_blendv_ps(f[opposite[kk]], relaxed, fluid);
+      _mm256_storeu_ps(&tmp_cells->speeds[kk][ii + row], out[kk]);
+    }
+
+    /* av_velocity */
+    u_x = _mm256_div_ps(_mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(out[1], out[5]), out[8]),
+                                      _mm256_add_ps(_mm256_add_ps(out[3], out[6]), out[7])), local_density);
+    u_y = _mm256_div_ps(_mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(out[2], out[5]), out[6]),
+                                      _mm256_add_ps(_mm256_add_ps(out[4], out[7]), out[8])), local_density);
+    acc = _mm256_add_ps(acc, _mm256_and_ps(fluid,
+                          _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(u_x, u_x), _mm256_mul_ps(u_y, u_y)))));
+  }
+  tot_u += merged_row_ops(params, cells, tmp_cells, obstacles, jj, ii, end);
+
+  float lanes[8];
+  _mm256_storeu_ps(lanes, acc);
+  for(int lane = 0; lane < 8; ++lane) {
+    tot_u += lanes[lane];
+  }
+  return tot_u;
+}
+
+__attribute__((target("avx512f")))
+float merged_row_ops_avx512(const t_param params, t_speed_arrays*restrict cells, t_speed_arrays*restrict tmp_cells,
+                            unsigned char*restrict obstacles, int jj, int start, int end) {
+  static const int opposite[NSPEEDS] = {0, 3, 4, 1, 2, 7, 8, 5, 6};
+  if(end - start < 16) {
+    return merged_row_ops(params, cells, tmp_cells, obstacles, jj, start, end);
+  }
+
+  const int row = jj*params.pitch;
+  const int row_n = row + params.pitch;
+  const int row_s = row - params.pitch;
+  const __m512 zero = _mm512_setzero_ps();
+  const __m512 one = _mm512_set1_ps(1.f);
+  const __m512 c_sq = _mm512_set1_ps(1.f / 3.f);                       /* square of speed of sound */
+  const __m512 two_c_sq = _mm512_set1_ps(2.f * (1.f / 3.f));
+  const __m512 two_c_sq_sq = _mm512_set1_ps(2.f * (1.f / 3.f) * (1.f / 3.f));
+  const __m512 w0 = _mm512_set1_ps(4.f / 9.f);
+  const __m512 w1 = _mm512_set1_ps(1.f / 9.f);
+  const __m512 w2 = _mm512_set1_ps(1.f / 36.f);
+  const __m512 omega = _mm512_set1_ps(params.omega);
+  __m512 acc = zero;
+
+  float tot_u = 0.f;
+  int ii = start;
+  for(; ii + 16 <= end; ii += 16) {
+    /* propagate */
+    __m512 f[NSPEEDS];
+    f[0] = _mm512_loadu_ps(&cells->speeds[0][ii + row]);
+    f[1] = _mm512_loadu_ps(&cells->speeds[1][ii - 1 + row]);
+    f[2] = _mm512_loadu_ps(&cells->speeds[2][ii + row_s]);
+    f[3] = _mm512_loadu_ps(&cells->speeds[3][ii + 1 + row]);
+    f[4] = _mm512_loadu_ps(&cells->speeds[4][ii + row_n]);
+    f[5] = _mm512_loadu_ps(&cells->speeds[5][ii - 1 + row_s]);
+    f[6] = _mm512_loadu_ps(&cells->speeds[6][ii + 1 + row_s]);
+    f[7] = _mm512_loadu_ps(&cells->speeds[7][ii + 1 + row_n]);
+    f[8] = _mm512_loadu_ps(&cells->speeds[8][ii - 1 + row_n]);
+
+    /* set for lanes without an obstacle, widened from 16 mask bytes */
+    __m512i blocked = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*) &obstacles[ii + row]));
+    __mmask16 fluid = _mm512_testn_epi32_mask(blocked, blocked);
+
+    /* collision */
+    __m512 local_density = f[0];
+    for(int kk = 1; kk < NSPEEDS; ++kk) {
+      local_density = _mm512_add_ps(local_density, f[kk]);
+    }
+    __m512 u_x = _mm512_div_ps(_mm512_sub_ps(_mm512_add_ps(_mm512_add_ps(f[1], f[5]), f[8]),
+                                             _mm512_add_ps(_mm512_add_ps(f[3], f[6]), f[7])), local_density);
+    __m512 u_y = _mm512_div_ps(_mm512_sub_ps(_mm512_add_ps(_mm512_add_ps(f[2], f[5]), f[6]),
+                                             _mm512_add_ps(_mm512_add_ps(f[4], f[7]), f[8])), local_density);
+    __m512 u_sq_term = _mm512_div_ps(_mm512_add_ps(_mm512_mul_ps(u_x, u_x), _mm512_mul_ps(u_y, u_y)), two_c_sq);
+
+    __m512 u[NSPEEDS];
+    u[1] = u_x;
+    u[2] = u_y;
+    u[3] = _mm512_sub_ps(zero, u_x);
+    u[4] = _mm512_sub_ps(zero, u_y);
+    u[5] = _mm512_add_ps(u_x, u_y);
+    u[6] = _mm512_sub_ps(u_y, u_x);
+    u[7] = _mm512_sub_ps(zero, u[5]);
+    u[8] = _mm512_sub_ps(u_x, u_y);
+
+    __m512 w1_density = _mm512_mul_ps(w1, local_density);
+    __m512 w2_density = _mm512_mul_ps(w2, local_density);
+    __m512 d_equ[NSPEEDS];
+    d_equ[0] = _mm512_mul_ps(_mm512_mul_ps(w0, local_density), _mm512_sub_ps(one, u_sq_term));
+    for(int kk = 1; kk < NSPEEDS; ++kk) {
+      d_equ[kk] = _mm512_mul_ps((kk < 5) ? w1_density : w2_density,
+                                _mm512_sub_ps(_mm512_add_ps(_mm512_add_ps(one, _mm512_div_ps(u[kk], c_sq)),
+                                                            _mm512_div_ps(_mm512_mul_ps(u[kk], u[kk]), two_c_sq_sq)),
+                                              u_sq_term));
+    }
+
+    /* relaxation for fluid lanes, rebound for obstacle lanes */
+    __m512 out[NSPEEDS];
+    for(int kk = 0; kk < NSPEEDS; ++kk) {
+      __m512 relaxed = _mm512_add_ps(f[kk], _mm512_mul_ps(omega, _mm512_sub_ps(d_equ[kk], f[kk])));
+      out[kk] = _mm512_mask_blend_ps(fluid, f[opposite[kk]], relaxed);
+      _mm512_storeu_ps(&tmp_cells->speeds[kk][ii + row], out[kk]);
+    }
+
+    /* av_velocity */
+    u_x = _mm512_div_ps(_mm512_sub_ps(_mm512_add_ps(_mm512_add_ps(out[1], out[5]), out[8]),
+                                      _mm512_add_ps(_mm512_add_ps(out[3], out[6]), out[7])), local_density);
+    u_y = _mm512_div_ps(_mm512_sub_ps(_mm512_add_ps(_mm512_add_ps(out[2], out[5]), out[6]),
+                                      _mm512_add_ps(_mm512_add_ps(out[4], out[7]), out[8])), local_density);
+    acc = _mm512_mask_add_ps(acc, fluid, acc,
+                             _mm512_sqrt_ps(_mm512_add_ps(_mm512_mul_ps(u_x, u_x), _mm512_mul_ps(u_y, u_y))));
+  }
+  tot_u += merged_row_ops(params, cells, tmp_cells, obstacles, jj, ii, end);
+
+  return tot_u + _mm512_reduce_add_ps(acc);
+}
+#endif
+
+const char* select_merged_kernel(void) {
+  merged_row_kernel = merged_row_ops;
+  sparse_fluid_kernel = sparse_fluid_ops;
+  half_row_kernel = merged_row_ops_half;
+  push_row_kernel = push_row_ops;
+  if(!SIMD_KERNEL) return "scalar";
+#if HAVE_X86_SIMD
+  __builtin_cpu_init();
+  if(PUSH_STREAMING) {
+    //the push step only ever uses this kernel
+    if(__builtin_cpu_supports("avx2")) {
+      push_row_kernel = push_row_ops_avx2;
+      return "avx2 push";
+    }
+    return "scalar";
+  }
+  if(HALF_STORAGE) {
+    //the 16 bit lattices only ever use this kernel
+    if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("f16c")) {
+      half_row_kernel = merged_row_ops_half_avx2;
+      return "avx2 f16c";
+    }
+    return "scalar";
+  }
+  if(__builtin_cpu_supports("avx512f")) {
+    merged_row_kernel = merged_row_ops_avx512;
+    sparse_fluid_kernel = sparse_fluid_ops_avx512;
+    return "avx512";
+  }
+  if(__builtin_cpu_supports("avx2")) {
+    merged_row_kernel = merged_row_ops_avx2;
+    sparse_fluid_kernel = sparse_fluid_ops_avx2;
+    return "avx2";
+  }
+#endif
+  return "scalar";
+}
+
+/*
+** AA-pattern streaming: a single lattice is updated in place, alternating two
+** kernels. With P(x, kk) the post-collision value of cell x for speed kk and
+** c_kk the direction of speed kk:
+**  - aa_even_step starts from the natural layout (slot kk of x holds P(x, kk)),
+**    pulls slot kk from x - c_kk, collides and writes P'(x, opposite[kk]) back
+**    into the slot it pulled speed kk from.
+**  - aa_odd_step finds every value it needs in its own cell (slot opposite[kk]
+**    holds the streamed speed kk), collides and writes the natural layout back.
+** A cell only ever touches the locations it reads from, so no scratch lattice is
+** needed. Obstacle cells are a no-op in both kernels, as bounce-back writes
+** every value straight back to where it was read from.
+*/
+void collide_cell(const t_param params, float* f)
+{
+  const float c_sq = 1.f / 3.f; /* square of speed of sound */
+  const float w0 = 4.f / 9.f;  /* weighting factor */
+  const float w1 = 1.f / 9.f;  /* weighting factor */
+  const float w2 = 1.f / 36.f; /* weighting factor */
+
+  /* compute local density total */
+  float local_density = 0.f;
+
+  for (int kk = 0; kk < NSPEEDS; kk++)
+  {
+    local_density += f[kk];
+  }
+
+  /* compute x velocity component */
+  float u_x = (f[1] + f[5] + f[8] - (f[3] + f[6] + f[7])) / local_density;
+  /* compute y velocity component */
+  float u_y = (f[2] + f[5] + f[6] - (f[4] + f[7] + f[8])) / local_density;
+
+  /* velocity squared */
+  float u_sq = u_x * u_x + u_y * u_y;
+
+  /* directional velocity components */
+  float u[NSPEEDS];
+  u[1] =   u_x;        /* east */
+  u[2] =         u_y;  /* north */
+  u[3] = - u_x;        /* west */
+  u[4] =       - u_y;  /* south */
+  u[5] =   u_x + u_y;  /* north-east */
+  u[6] = - u_x + u_y;  /* north-west */
+  u[7] = - u_x - u_y;  /* south-west */
+  u[8] =   u_x - u_y;  /* south-east */
+
+  /* equilibrium densities */
+  float d_equ[NSPEEDS];
+  /* zero velocity density: weight w0 */
+  d_equ[0] = w0 * local_density * (1.f - u_sq / (2.f * c_sq));
+  /* axis speeds: weight w1, diagonal speeds: weight w2 */
+  for (int kk = 1; kk < NSPEEDS; kk++)
+  {
+    d_equ[kk] = ((kk < 5) ? w1 : w2) * local_density * (1.f + u[kk] / c_sq
+                                                        + (u[kk] * u[kk]) / (2.f * c_sq * c_sq)
+                                                        - u_sq / (2.f * c_sq));
+  }
+
+  /* relaxation step */
+  for (int kk = 0; kk < NSPEEDS; kk++)
+  {
+    f[kk] = f[kk] + params.omega * (d_equ[kk] - f[kk]);
+  }
+}
+
+float cell_velocity(const float* f)
+{
+  float local_density = 0.f;
+
+  for (int kk = 0; kk < NSPEEDS; kk++)
+  {
+    local_density += f[kk];
+  }
+
+  float u_x = (f[1] + f[5] + f[8] - (f[3] + f[6] + f[7])) / local_density;
+  float u_y = (f[2] + f[5] + f[6] - (f[4] + f[7] + f[8])) / local_density;
+
+  return sqrtf((u_x * u_x) + (u_y * u_y));
+}
+
+float aa_even_step(const t_param params, t_speed_arrays* cells, unsigned char* obstacles)
+{
+  static const int opposite[NSPEEDS] = {0, 3, 4, 1, 2, 7, 8, 5, 6};
+  float tot_u = 0.f;
+
+  /* halos are only read and written through their neighbours */
+  #pragma omp parallel for schedule(static) reduction(+:tot_u)
+  for (int jj = params.halo_rows; jj < params.ny - params.halo_rows; jj++)
+  {
+    int y_n = jj + 1;
+    int y_s = jj - 1;
+    for (int ii = 1; ii < params.nx - 1; ii++)
+    {
+      if (obstacles[ii + jj*params.pitch]) continue;
+
+      int x_e = ii + 1;
+      int x_w = ii - 1;
+      /* slot kk of cell x - c_kk, for every speed kk */
+      int idx[NSPEEDS];
+      idx[0] = ii + jj*params.pitch;
+      idx[1] = x_w + jj*params.pitch;
+      idx[2] = ii + y_s*params.pitch;
+      idx[3] = x_e + jj*params.pitch;
+      idx[4] = ii + y_n*params.pitch;
+      idx[5] = x_w + y_s*params.pitch;
+      idx[6] = x_e + y_s*params.pitch;
+      idx[7] = x_e + y_n*params.pitch;
+      idx[8] = x_w + y_n*params.pitch;
+
+      float f[NSPEEDS];
+      for (int kk = 0; kk < NSPEEDS; kk++)
+      {
+        f[kk] = cells->speeds[kk][idx[kk]];
+      }
+      collide_cell(params, f);
+      for (int kk = 0; kk < NSPEEDS; kk++)
+      {
+        cells->speeds[kk][idx[kk]] = f[opposite[kk]];
+      }
+      tot_u += cell_velocity(f);
+    }
+  }
+
+  return tot_u;
+}
+
+float aa_odd_step(const t_param params, t_speed_arrays* cells, unsigned char* obstacles)
+{
+  static const int opposite[NSPEEDS] = {0, 3, 4, 1, 2, 7, 8, 5, 6};
+  float tot_u = 0.f;
+
+  #pragma omp parallel for schedule(static) reduction(+:tot_u)
+  for (int jj = params.halo_rows; jj < params.ny - params.halo_rows; jj++)
+  {
+    for (int ii = 1; ii < params.nx - 1; ii++)
+    {
+      if (obstacles[ii + jj*params.pitch]) continue;
+
+      float f[NSPEEDS];
+      for (int kk = 0; kk < NSPEEDS; kk++)
+      {
+        f[kk] = cells->speeds[opposite[kk]][ii + jj*params.pitch];
+      }
+      collide_cell(params, f);
+      for (int kk = 0; kk < NSPEEDS; kk++)
+      {
+        cells->speeds[kk][ii + jj*params.pitch] = f[kk];
+      }
+      tot_u += cell_velocity(f);
+    }
+  }
+
+  return tot_u;
+}
+
+int accelerate_flow_aa_odd(const t_param params, t_speed_arrays* cells, unsigned char* obstacles)
+{
+  /* compute weighting factors */
+  float w1 = params.density * params.accel / 9.f;
+  float w2 = params.density * params.accel / 36.f;
+
+  /* modify the 2nd row of the grid, if it is owned */
+  int jj = params.accel_row;
+  if(jj < params.halo_rows || jj >= params.ny - params.halo_rows) return EXIT_SUCCESS;
+  int y_n = jj + 1;
+  int y_s = jj - 1;
+
+  /* after an even step P(x, kk) lives in slot opposite[kk] of x + c_kk.
+  ** Values of boundary cells stored in the halo cols are ours until
+  ** exchange_halos_aa_reverse hands them over, so only owned cells are done */
+  #pragma omp parallel for schedule(static)
+  for (int ii = 1; ii < params.nx - 1; ii++)
+  {
+    if (!obstacles[ii + jj*params.pitch]
+        && (cells->speeds[1][(ii - 1) + jj*params.pitch] - w1) > 0.f
+        && (cells->speeds[8][(ii - 1) + y_n*params.pitch] - w2) > 0.f
+        && (cells->speeds[5][(ii - 1) + y_s*params.pitch] - w2) > 0.f)
+    {
+      /* increase 'east-side' densities */
+      cells->speeds[3][(ii + 1) + jj*params.pitch] += w1;
+      cells->speeds[7][(ii + 1) + y_n*params.pitch] += w2;
+      cells->speeds[6][(ii + 1) + y_s*params.pitch] += w2;
+      /* decrease 'west-side' densities */
+      cells->speeds[1][(ii - 1) + jj*params.pitch] -= w1;
+      cells->speeds[8][(ii - 1) + y_n*params.pitch] -= w2;
+      cells->speeds[5][(ii - 1) + y_s*params.pitch] -= w2;
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/* put the result of an even step back into the natural layout, for output */
+void aa_to_natural(const t_param params, t_speed_arrays* cells, t_speed_arrays* natural)
+{
+  static const int opposite[NSPEEDS] = {0, 3, 4, 1, 2, 7, 8, 5, 6};
+  for (int jj = params.halo_rows; jj < params.ny - params.halo_rows; jj++)
+  {
+    int y_n = jj + 1;
+    int y_s = jj - 1;
+    for (int ii = 1; ii < params.nx - 1; ii++)
+    {
+      int x_e = ii + 1;
+      int x_w = ii - 1;
+      /* cell x + c_kk, for every speed kk */
+      int idx[NSPEEDS];
+      idx[0] = ii + jj*params.pitch;
+      idx[1] = x_e + jj*params.pitch;
+      idx[2] = ii + y_n*params.pitch;
+      idx[3] = x_w + jj*params.pitch;
+      idx[4] = ii + y_s*params.pitch;
+      idx[5] = x_e + y_n*params.pitch;
+      idx[6] = x_w + y_n*params.pitch;
+      idx[7] = x_w + y_s*params.pitch;
+      idx[8] = x_e + y_s*params.pitch;
+      for (int kk = 0; kk < NSPEEDS; kk++)
+      {
+        natural->speeds[kk][ii + jj*params.pitch] = cells->speeds[opposite[kk]][idx[kk]];
+      }
+    }
+  }
+}
+
+/*
+** Push streaming keeps the lattice streamed but not yet collided, so a step
+** reads every cell only from itself and writes it out to its neighbours.
+** Start it from the natural layout of cells, whose halos must be filled:
+** stream the owned cells into tmp_cells, as the pull step does before it
+** collides.
+*/
+void push_prologue(const t_param params, t_speed_arrays* cells, t_speed_arrays* tmp_cells)
+{
+  static const int dx[NSPEEDS] = {0, 1, 0, -1, 0, 1, -1, -1, 1};
+  static const int dy[NSPEEDS] = {0, 0, 1, 0, -1, 1, 1, -1, -1};
+
+  #pragma omp parallel for schedule(static)
+  for (int jj = params.halo_rows; jj < params.ny - params.halo_rows; jj++)
+  {
+    for (int kk = 0; kk < NSPEEDS; kk++)
+    {
+      for (int ii = params.halo_cols; ii < params.nx - params.halo_cols; ii++)
+      {
+        tmp_cells->speeds[kk][ii + jj*params.pitch] = cells->speeds[kk][(ii - dx[kk]) + (jj - dy[kk])*params.pitch];
+      }
+    }
+  }
+}
+
+/* one push step over the owned cells into tmp_cells, returns their summed velocity like merged_timestep_ops() */
+float push_timestep_ops(const t_param params, t_speed_arrays*restrict cells, t_speed_arrays*restrict tmp_cells,
+                        unsigned char*restrict obstacles, int stream)
+{
+  float* const* send_cols = halo_types(params, tmp_cells)->push_cols;
+  float tot_u = 0.f;         /* accumulated magnitudes of velocity for each cell */
+
+  /* a cell only writes slots no other cell writes, so rows can go to any thread */
+  #pragma omp parallel for schedule(static) reduction(+:tot_u)
+  for (int jj = params.halo_rows; jj < params.ny - params.halo_rows; jj++)
+  {
+    tot_u += push_row_kernel(params, cells, tmp_cells, obstacles, send_cols, stream, jj, params.halo_cols, params.nx - params.halo_cols);
+  }
 
-        //AV VELOCITY CODE
-        /* accumulate the norm of x- and y- velocity components */
-        if(ii != 0 && ii != params.nx-1) {
-          u_x = (tmp_cells->speeds[1][ii + jj*params.nx]
-                        + tmp_cells->speeds[5][ii + jj*params.nx]
-                        + tmp_cells->speeds[8][ii + jj*params.nx]
-                        - (tmp_cells->speeds[3][ii + jj*params.nx]
-                           + tmp_cells->speeds[6][ii + jj*params.nx]
-                           + tmp_cells->speeds[7][ii + jj*params.nx]))
-                       / local_density;
-          /* compute y velocity component */
-          u_y = (tmp_cells->speeds[2][ii + jj*params.nx]
-                        + tmp_cells->speeds[5][ii + jj*params.nx]
-                        + tmp_cells->speeds[6][ii + jj*params.nx]
-                        - (tmp_cells->speeds[4][ii + jj*params.nx]
-                           + tmp_cells->speeds[7][ii + jj*params.nx]
-                           + tmp_cells->speeds[8][ii + jj*params.nx]))
-                       / local_density;
+  return tot_u;
+}
 
-          tot_u += sqrtf((u_x * u_x) + (u_y * u_y));
-        }
-        //DONE AV_VELOCITY
+/*
+** Push step over cols [start, end) of row jj: collide or rebound every cell
+** from its own streamed values, accelerate it if it is in the accelerated
+** row, then stream the result to its neighbours in tmp_cells. Whatever
+** streams into the left or right halo col goes into send_cols[0] or [1]
+** instead, speed s of the three leaving that way at send_cols[side][s*ny + row],
+** the layout exchange_halos_push() sends. Without stream the result stays in
+** its cell unaccelerated, which puts the last step in the natural layout.
+*/
+float push_row_ops(const t_param params, t_speed_arrays*restrict cells, t_speed_arrays*restrict tmp_cells,
+                   unsigned char*restrict obstacles, float* const* send_cols, int stream, int jj, int start, int end)
+{
+  static const int opposite[NSPEEDS] = {0, 3, 4, 1, 2, 7, 8, 5, 6};
+  static const int dx[NSPEEDS] = {0, 1, 0, -1, 0, 1, -1, -1, 1};
+  static const int dy[NSPEEDS] = {0, 0, 1, 0, -1, 1, 1, -1, -1};
+  static const int col_slot[NSPEEDS] = {-1, 0, -1, 0, -1, 1, 1, 2, 2};  /* place among 1/5/8 or 3/6/7 */
+  const int accel = stream && params.accel_row >= 0 && (jj - params.accel_row) % params.accel_stride == 0;
+  const float w1 = params.density * params.accel / 9.f;
+  const float w2 = params.density * params.accel / 36.f;
+
+  float tot_u = 0.f;
+  for (int ii = start; ii < end; ii++)
+  {
+    float f[NSPEEDS];
+    for (int kk = 0; kk < NSPEEDS; kk++)
+    {
+      f[kk] = cells->speeds[kk][ii + jj*params.pitch];
+    }
+    float out[NSPEEDS];
+    if (obstacles[ii + jj*params.pitch])
+    {
+      for (int kk = 0; kk < NSPEEDS; kk++)
+      {
+        out[kk] = f[opposite[kk]];
       }
-      // COLLISION DONE
+    }
+    else
+    {
+      collide_cell(params, f);
+      memcpy(out, f, sizeof(out));
+      tot_u += cell_velocity(out);
+      /* if we don't send a negative density */
+      if (accel && (out[3] - w1) > 0.f && (out[6] - w2) > 0.f && (out[7] - w2) > 0.f)
+      {
+        out[1] += w1;
+        out[5] += w2;
+        out[8] += w2;
+        out[3] -= w1;
+        out[6] -= w2;
+        out[7] -= w2;
+      }
+    }
 
-      /*
-      currentVal = tmp_cells[jj*params.nx + ii];
-      printf("AFTER: speed1: %d, speed2: %d, speed6: %d\n", currentVal.speed[1],
-                                      currentVal.speed[2], currentVal.speed[6]);
-      */
+    for (int kk = 0; kk < NSPEEDS; kk++)
+    {
+      if (!stream)
+      {
+        tmp_cells->speeds[kk][ii + jj*params.pitch] = out[kk];
+        continue;
+      }
+      int to_ii = ii + dx[kk];
+      int to_jj = jj + dy[kk];
+      if (to_ii == 0 || to_ii == params.nx - 1)
+      {
+        send_cols[to_ii != 0][col_slot[kk]*params.ny + to_jj] = out[kk];
+      }
+      else
+      {
+        tmp_cells->speeds[kk][to_ii + to_jj*params.pitch] = out[kk];
+      }
+    }
+  }
+  return tot_u;
+}
+
+#if HAVE_X86_SIMD
+/*
+** push_row_ops() eight cells at a time, with the arithmetic of
+** merged_row_ops_avx2(). The loads are all from the cell itself; the cols
+** next to the halos stream into send_cols and stay with the scalar kernel.
+*/
+__attribute__((target("avx2")))
+float push_row_ops_avx2(const t_param params, t_speed_arrays*restrict cells, t_speed_arrays*restrict tmp_cells,
+                        unsigned char*restrict obstacles, float* const* send_cols, int stream, int jj, int start, int end) {
+  static const int opposite[NSPEEDS] = {0, 3, 4, 1, 2, 7, 8, 5, 6};
+  static const int dx[NSPEEDS] = {0, 1, 0, -1, 0, 1, -1, -1, 1};
+  static const int dy[NSPEEDS] = {0, 0, 1, 0, -1, 1, 1, -1, -1};
+  const int vec_start = stream ? max(start, 2) : start;
+  const int vec_end = stream ? min(end, params.nx - 2) : end;
+  if(vec_end - vec_start < 8) {
+    return push_row_ops(params, cells, tmp_cells, obstacles, send_cols, stream, jj, start, end);
+  }
+
+  const int row = jj*params.pitch;
+  int dest[NSPEEDS];  /* where each speed of cell ii goes, relative to ii + row */
+  for(int kk = 0; kk < NSPEEDS; ++kk) {
+    dest[kk] = stream ? dx[kk] + dy[kk]*params.pitch : 0;
+  }
+  const int accel = stream && params.accel_row >= 0 && (jj - params.accel_row) % params.accel_stride == 0;
+  const __m256 accel_w1 = _mm256_set1_ps(params.density * params.accel / 9.f);
+  const __m256 accel_w2 = _mm256_set1_ps(params.density * params.accel / 36.f);
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 one = _mm256_set1_ps(1.f);
+  const __m256 c_sq = _mm256_set1_ps(1.f / 3.f);                       /* square of speed of sound */
+  const __m256 two_c_sq = _mm256_set1_ps(2.f * (1.f / 3.f));
+  const __m256 two_c_sq_sq = _mm256_set1_ps(2.f * (1.f / 3.f) * (1.f / 3.f));
+  const __m256 w0 = _mm256_set1_ps(4.f / 9.f);
+  const __m256 w1 = _mm256_set1_ps(1.f / 9.f);
+  const __m256 w2 = _mm256_set1_ps(1.f / 36.f);
+  const __m256 omega = _mm256_set1_ps(params.omega);
+  __m256 acc = zero;
+
+  float tot_u = push_row_ops(params, cells, tmp_cells, obstacles, send_cols, stream, jj, start, vec_start);
+  int ii = vec_start;
+  for(; ii + 8 <= vec_end; ii += 8) {
+    __m256 f[NSPEEDS];
+    for(int kk = 0; kk < NSPEEDS; ++kk) {
+      f[kk] = _mm256_loadu_ps(&cells->speeds[kk][ii + row]);
+    }
+
+    /* all bits set in lanes without an obstacle, widened from 8 mask bytes */
+    __m256i blocked = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*) &obstacles[ii + row]));
+    __m256 fluid = _mm256_castsi256_ps(_mm256_cmpeq_epi32(blocked, _mm256_setzero_si256()));
+
+    /* collision */
+    __m256 local_density = f[0];
+    for(int kk = 1; kk < NSPEEDS; ++kk) {
+      local_density = _mm256_add_ps(local_density, f[kk]);
+    }
+    __m256 u_x = _mm256_div_ps(_mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(f[1], f[5]), f[8]),
+                                             _mm256_add_ps(_mm256_add_ps(f[3], f[6]), f[7])), local_density);
+    __m256 u_y = _mm256_div_ps(_mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(f[2], f[5]), f[6]),
+                                             _mm256_add_ps(_mm256_add_ps(f[4], f[7]), f[8])), local_density);
+    __m256 u_sq_term = _mm256_div_ps(_mm256_add_ps(_mm256_mul_ps(u_x, u_x), _mm256_mul_ps(u_y, u_y)), two_c_sq);
+
+    __m256 u[NSPEEDS];
+    u[1] = u_x;
+    u[2] = u_y;
+    u[3] = _mm256_sub_ps(zero, u_x);
+    u[4] = _mm256_sub_ps(zero, u_y);
+    u[5] = _mm256_add_ps(u_x, u_y);
+    u[6] = _mm256_sub_ps(u_y, u_x);
+    u[7] = _mm256_sub_ps(zero, u[5]);
+    u[8] = _mm256_sub_ps(u_x, u_y);
+
+    __m256 w1_density = _mm256_mul_ps(w1, local_density);
+    __m256 w2_density = _mm256_mul_ps(w2, local_density);
+    __m256 d_equ[NSPEEDS];
+    d_equ[0] = _mm256_mul_ps(_mm256_mul_ps(w0, local_density), _mm256_sub_ps(one, u_sq_term));
+    for(int kk = 1; kk < NSPEEDS; ++kk) {
+      d_equ[kk] = _mm256_mul_ps((kk < 5) ? w1_density : w2_density,
+                                _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(one, _mm256_div_ps(u[kk], c_sq)),
+                                                            _mm256_div_ps(_mm256_mul_ps(u[kk], u[kk]), two_c_sq_sq)),
+                                              u_sq_term));
+    }
+
+    /* relaxation for fluid lanes, rebound for obstacle lanes */
+    __m256 out[NSPEEDS];
+    for(int kk = 0; kk < NSPEEDS; ++kk) {
+      __m256 relaxed = _mm256_add_ps(f[kk], _mm256_mul_ps(omega, _mm256_sub_ps(d_equ[kk], f[kk])));
+      out[kk] = _mm256_blendv_ps(f[opposite[kk]], relaxed, fluid);
+    }
+
+    /* av_velocity */
+    u_x = _mm256_div_ps(_mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(out[1], out[5]), out[8]),
+                                      _mm256_add_ps(_mm256_add_ps(out[3], out[6]), out[7])), local_density);
+    u_y = _mm256_div_ps(_mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(out[2], out[5]), out[6]),
+                                      _mm256_add_ps(_mm256_add_ps(out[4], out[7]), out[8])), local_density);
+    acc = _mm256_add_ps(acc, _mm256_and_ps(fluid,
+                          _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(u_x, u_x), _mm256_mul_ps(u_y, u_y)))));
+
+    /* accelerate the fluid lanes that don't go negative */
+    if(accel) {
+      __m256 ok = _mm256_and_ps(fluid, _mm256_cmp_ps(_mm256_sub_ps(out[3], accel_w1), zero, _CMP_GT_OQ));
+      ok = _mm256_and_ps(ok, _mm256_cmp_ps(_mm256_sub_ps(out[6], accel_w2), zero, _CMP_GT_OQ));
+      ok = _mm256_and_ps(ok, _mm256_cmp_ps(_mm256_sub_ps(out[7], accel_w2), zero, _CMP_GT_OQ));
+      __m256 a1 = _mm256_and_ps(ok, accel_w1);
+      __m256 a2 = _mm256_and_ps(ok, accel_w2);
+      out[1] = _mm256_add_ps(out[1], a1);
+      out[5] = _mm256_add_ps(out[5], a2);
+      out[8] = _mm256_add_ps(out[8], a2);
+      out[3] = _mm256_sub_ps(out[3], a1);
+      out[6] = _mm256_sub_ps(out[6], a2);
+      out[7] = _mm256_sub_ps(out[7], a2);
+    }
 
+    /* stream */
+    for(int kk = 0; kk < NSPEEDS; ++kk) {
+      _mm256_storeu_ps(&tmp_cells->speeds[kk][ii + row + dest[kk]], out[kk]);
     }
   }
+  tot_u += push_row_ops(params, cells, tmp_cells, obstacles, send_cols, stream, jj, ii, end);
 
+  float lanes[8];
+  _mm256_storeu_ps(lanes, acc);
+  for(int lane = 0; lane < 8; ++lane) {
+    tot_u += lanes[lane];
+  }
   return tot_u;
 }
+#endif
 
-int rebound(const t_param params, t_speed_arrays* cells, t_speed_arrays* tmp_cells, int* obstacles, int flag)
+int rebound(const t_param params, t_speed_arrays* cells, t_speed_arrays* tmp_cells, unsigned char* obstacles, int flag)
 {
   int start, end, increment;
   if(flag == 0) {
@@ -1187,18 +4400,18 @@ int rebound(const t_param params, t_speed_arrays* cells, t_speed_arrays* tmp_cel
         ii = params.nx - 2;
       }
       /* if the cell contains an obstacle */
-      if (obstacles[jj*params.nx + ii])
+      if (obstacles[jj*params.pitch + ii])
       {
         /* called after propagate, so taking values from scratch space
         ** mirroring, and writing into main grid */
-        cells->speeds[1][ii + jj*params.nx] = tmp_cells->speeds[3][ii + jj*params.nx];
-        cells->speeds[2][ii + jj*params.nx] = tmp_cells->speeds[4][ii + jj*params.nx];
-        cells->speeds[3][ii + jj*params.nx] = tmp_cells->speeds[1][ii + jj*params.nx];
-        cells->speeds[4][ii + jj*params.nx] = tmp_cells->speeds[2][ii + jj*params.nx];
-        cells->speeds[5][ii + jj*params.nx] = tmp_cells->speeds[7][ii + jj*params.nx];
-        cells->speeds[6][ii + jj*params.nx] = tmp_cells->speeds[8][ii + jj*params.nx];
-        cells->speeds[7][ii + jj*params.nx] = tmp_cells->speeds[5][ii + jj*params.nx];
-        cells->speeds[8][ii + jj*params.nx] = tmp_cells->speeds[6][ii + jj*params.nx];
+        cells->speeds[1][ii + jj*params.pitch] = tmp_cells->speeds[3][ii + jj*params.pitch];
+        cells->speeds[2][ii + jj*params.pitch] = tmp_cells->speeds[4][ii + jj*params.pitch];
+        cells->speeds[3][ii + jj*params.pitch] = tmp_cells->speeds[1][ii + jj*params.pitch];
+        cells->speeds[4][ii + jj*params.pitch] = tmp_cells->speeds[2][ii + jj*params.pitch];
+        cells->speeds[5][ii + jj*params.pitch] = tmp_cells->speeds[7][ii + jj*params.pitch];
+        cells->speeds[6][ii + jj*params.pitch] = tmp_cells->speeds[8][ii + jj*params.pitch];
+        cells->speeds[7][ii + jj*params.pitch] = tmp_cells->speeds[5][ii + jj*params.pitch];
+        cells->speeds[8][ii + jj*params.pitch] = tmp_cells->speeds[6][ii + jj*params.pitch];
       }
     }
   }
@@ -1216,7 +4429,7 @@ void test_vels(const char* output_file, float *vels, int steps) {
   fclose(fp);
 }
 
-int collision(const t_param params, t_speed_arrays* cells, t_speed_arrays* tmp_cells, int* obstacles, int flag)
+int collision(const t_param params, t_speed_arrays* cells, t_speed_arrays* tmp_cells, unsigned char* obstacles, int flag)
 {
   int start, end, increment;
   if(flag == 0) {
@@ -1249,31 +4462,31 @@ int collision(const t_param params, t_speed_arrays* cells, t_speed_arrays* tmp_c
         ii = params.nx - 2;
       }
       /* don't consider occupied cells */
-      if (!obstacles[ii + jj*params.nx])
+      if (!obstacles[ii + jj*params.pitch])
       {
         /* compute local density total */
         float local_density = 0.f;
 
         for (int kk = 0; kk < NSPEEDS; kk++)
         {
-          local_density += tmp_cells->speeds[kk][ii + jj*params.nx];
+          local_density += tmp_cells->speeds[kk][ii + jj*params.pitch];
         }
 
         /* compute x velocity component */
-        float u_x = (tmp_cells->speeds[1][ii + jj*params.nx]
-                      + tmp_cells->speeds[5][ii + jj*params.nx]
-                      + tmp_cells->speeds[8][ii + jj*params.nx]
-                      - (tmp_cells->speeds[3][ii + jj*params.nx]
-                         + tmp_cells->speeds[6][ii + jj*params.nx]
-                         + tmp_cells->speeds[7][ii + jj*params.nx]))
+        float u_x = (tmp_cells->speeds[1][ii + jj*params.pitch]
+                      + tmp_cells->speeds[5][ii + jj*params.pitch]
+                      + tmp_cells->speeds[8][ii + jj*params.pitch]
+                      - (tmp_cells->speeds[3][ii + jj*params.pitch]
+                         + tmp_cells->speeds[6][ii + jj*params.pitch]
+                         + tmp_cells->speeds[7][ii + jj*params.pitch]))
                      / local_density;
         /* compute y velocity component */
-        float u_y = (tmp_cells->speeds[2][ii + jj*params.nx]
-                      + tmp_cells->speeds[5][ii + jj*params.nx]
-                      + tmp_cells->speeds[6][ii + jj*params.nx]
-                      - (tmp_cells->speeds[4][ii + jj*params.nx]
-                         + tmp_cells->speeds[7][ii + jj*params.nx]
-                         + tmp_cells->speeds[8][ii + jj*params.nx]))
+        float u_y = (tmp_cells->speeds[2][ii + jj*params.pitch]
+                      + tmp_cells->speeds[5][ii + jj*params.pitch]
+                      + tmp_cells->speeds[6][ii + jj*params.pitch]
+                      - (tmp_cells->speeds[4][ii + jj*params.pitch]
+                         + tmp_cells->speeds[7][ii + jj*params.pitch]
+                         + tmp_cells->speeds[8][ii + jj*params.pitch]))
                      / local_density;
 
         /* velocity squared */
@@ -1325,9 +4538,9 @@ int collision(const t_param params, t_speed_arrays* cells, t_speed_arrays* tmp_c
         /* relaxation step */
         for (int kk = 0; kk < NSPEEDS; kk++)
         {
-          cells->speeds[kk][ii + jj*params.nx] = tmp_cells->speeds[kk][ii + jj*params.nx]
+          cells->speeds[kk][ii + jj*params.pitch] = tmp_cells->speeds[kk][ii + jj*params.pitch]
                                                   + params.omega
-                                                  * (d_equ[kk] - tmp_cells->speeds[kk][ii + jj*params.nx]);
+                                                  * (d_equ[kk] - tmp_cells->speeds[kk][ii + jj*params.pitch]);
         }
       }
     }
@@ -1336,7 +4549,7 @@ int collision(const t_param params, t_speed_arrays* cells, t_speed_arrays* tmp_c
   return EXIT_SUCCESS;
 }
 
-float av_velocity(const t_param params, t_speed_arrays* cells, int* obstacles, int flag)
+float av_velocity(const t_param params, t_speed_arrays* cells, unsigned char* obstacles, int flag)
 {
   int start, end, increment;
   if(flag == 0) {
@@ -1348,11 +4561,19 @@ float av_velocity(const t_param params, t_speed_arrays* cells, int* obstacles, i
     end = params.nx-1;
     increment = params.nx-3;
   } else {
-    start = 1;
-    end = params.nx-1;
+    start = params.halo_cols;
+    end = params.nx - params.halo_cols;
     increment = 1;
   }
 
+  return av_velocity_block(params, cells, obstacles, params.halo_rows, params.ny - params.halo_rows,
+                           start, end, increment);
+}
+
+/* summed velocity of the non-blocked cells in cols [start, end) of rows [row_start, row_end) */
+float av_velocity_block(const t_param params, t_speed_arrays* cells, unsigned char* obstacles, int row_start, int row_end,
+                        int start, int end, int increment)
+{
   int    tot_cells = 0;  /* no. of cells used in calculation */
   float tot_u;          /* accumulated magnitudes of velocity for each cell */
 
@@ -1360,36 +4581,37 @@ float av_velocity(const t_param params, t_speed_arrays* cells, int* obstacles, i
   tot_u = 0.f;
 
   /* loop over all non-blocked cells */
-  for (int jj = 0; jj < params.ny; jj++)
+  #pragma omp parallel for schedule(static) reduction(+:tot_u,tot_cells)
+  for (int jj = row_start; jj < row_end; jj++)
   {
     for (int ii = start; ii < end; ii += increment)
     {
       /* ignore occupied cells */
-      if (!obstacles[ii + jj*params.nx])
+      if (!obstacles[ii + jj*params.pitch])
       {
         /* local density total */
         float local_density = 0.f;
 
         for (int kk = 0; kk < NSPEEDS; kk++)
         {
-          local_density += cells->speeds[kk][ii + jj*params.nx];
+          local_density += cells->speeds[kk][ii + jj*params.pitch];
         }
 
         /* x-component of velocity */
-        float u_x = (cells->speeds[1][ii + jj*params.nx]
-                      + cells->speeds[5][ii + jj*params.nx]
-                      + cells->speeds[8][ii + jj*params.nx]
-                      - (cells->speeds[3][ii + jj*params.nx]
-                         + cells->speeds[6][ii + jj*params.nx]
-                         + cells->speeds[7][ii + jj*params.nx]))
+        float u_x = (cells->speeds[1][ii + jj*params.pitch]
+                      + cells->speeds[5][ii + jj*params.pitch]
+                      + cells->speeds[8][ii + jj*params.pitch]
+                      - (cells->speeds[3][ii + jj*params.pitch]
+                         + cells->speeds[6][ii + jj*params.pitch]
+                         + cells->speeds[7][ii + jj*params.pitch]))
                      / local_density;
         /* compute y velocity component */
-        float u_y = (cells->speeds[2][ii + jj*params.nx]
-                      + cells->speeds[5][ii + jj*params.nx]
-                      + cells->speeds[6][ii + jj*params.nx]
-                      - (cells->speeds[4][ii + jj*params.nx]
-                         + cells->speeds[7][ii + jj*params.nx]
-                         + cells->speeds[8][ii + jj*params.nx]))
+        float u_y = (cells->speeds[2][ii + jj*params.pitch]
+                      + cells->speeds[5][ii + jj*params.pitch]
+                      + cells->speeds[6][ii + jj*params.pitch]
+                      - (cells->speeds[4][ii + jj*params.pitch]
+                         + cells->speeds[7][ii + jj*params.pitch]
+                         + cells->speeds[8][ii + jj*params.pitch]))
                      / local_density;
         /* accumulate the norm of x- and y- velocity components */
         tot_u += sqrtf((u_x * u_x) + (u_y * u_y));
@@ -1403,9 +4625,13 @@ float av_velocity(const t_param params, t_speed_arrays* cells, int* obstacles, i
   return tot_u;
 }
 
-int initialise(const char* paramfile, const char* obstaclefile,
-               t_param* params, t_speed_arrays** cells_ptr, t_speed_arrays** tmp_cells_ptr,
-               int** obstacles_ptr, float** av_vels_ptr)
+/*
+** Initialise the owned block of this process and its halos to the
+** equilibrium densities and read the obstacles that fall inside the block.
+** No process ever holds more than its own block.
+*/
+int initialise(const char* obstaclefile, const t_decomp* decomp, const t_param params,
+               const t_param child_params, t_speed_arrays* child_cells, unsigned char* child_obstacles)
 {
   char   message[1024];  /* message buffer */
   FILE*   fp;            /* file pointer */
@@ -1413,111 +4639,30 @@ int initialise(const char* paramfile, const char* obstaclefile,
   int    blocked;        /* indicates whether a cell is blocked by an obstacle */
   int    retval;         /* to hold return value for checking */
 
-  /* open the parameter file */
-  fp = fopen(paramfile, "r");
-
-  if (fp == NULL)
-  {
-    sprintf(message, "could not open input parameter file: %s", paramfile);
-    die(message, __LINE__, __FILE__);
-  }
-
-  /* read in the parameter values */
-  retval = fscanf(fp, "%d\n", &(params->nx));
-
-  if (retval != 1) die("could not read param file: nx", __LINE__, __FILE__);
-
-  retval = fscanf(fp, "%d\n", &(params->ny));
-
-  if (retval != 1) die("could not read param file: ny", __LINE__, __FILE__);
-
-  retval = fscanf(fp, "%d\n", &(params->maxIters));
-
-  if (retval != 1) die("could not read param file: maxIters", __LINE__, __FILE__);
-
-  retval = fscanf(fp, "%d\n", &(params->reynolds_dim));
-
-  if (retval != 1) die("could not read param file: reynolds_dim", __LINE__, __FILE__);
-
-  retval = fscanf(fp, "%f\n", &(params->density));
-
-  if (retval != 1) die("could not read param file: density", __LINE__, __FILE__);
-
-  retval = fscanf(fp, "%f\n", &(params->accel));
-
-  if (retval != 1) die("could not read param file: accel", __LINE__, __FILE__);
-
-  retval = fscanf(fp, "%f\n", &(params->omega));
-
-  if (retval != 1) die("could not read param file: omega", __LINE__, __FILE__);
-
-  /* and close up the file */
-  fclose(fp);
-
-  /*
-  ** Allocate memory.
-  **
-  ** Remember C is pass-by-value, so we need to
-  ** pass pointers into the initialise function.
-  **
-  ** NB we are allocating a 1D array, so that the
-  ** memory will be contiguous.  We still want to
-  ** index this memory as if it were a (row major
-  ** ordered) 2D array, however.  We will perform
-  ** some arithmetic using the row and column
-  ** coordinates, inside the square brackets, when
-  ** we want to access elements of this array.
-  **
-  ** Note also that we are using a structure to
-  ** hold an array of 'speeds'.  We will allocate
-  ** a 1D array of these structs.
-  */
-
-  /* main grid */
-  *cells_ptr = create_t_speed_arrays(*params);
-
-  if (*cells_ptr == NULL) die("cannot allocate memory for cells", __LINE__, __FILE__);
-
-  /* 'helper' grid, used as scratch space */
-  *tmp_cells_ptr = create_t_speed_arrays(*params);
-
-  if (*tmp_cells_ptr == NULL) die("cannot allocate memory for tmp_cells", __LINE__, __FILE__);
-
-  /* the map of obstacles */
-  *obstacles_ptr = malloc(sizeof(int) * (params->ny * params->nx));
-
-  if (*obstacles_ptr == NULL) die("cannot allocate column memory for obstacles", __LINE__, __FILE__);
-
   /* initialise densities */
-  float w0 = params->density * 4.f / 9.f;
-  float w1 = params->density      / 9.f;
-  float w2 = params->density      / 36.f;
+  float w0 = params.density * 4.f / 9.f;
+  float w1 = params.density      / 9.f;
+  float w2 = params.density      / 36.f;
 
-  for (int jj = 0; jj < params->ny; jj++)
+  #pragma omp parallel for schedule(static)
+  for (int jj = 0; jj < child_params.ny; jj++)
   {
-    for (int ii = 0; ii < params->nx; ii++)
+    for (int ii = 0; ii < child_params.nx; ii++)
     {
       /* centre */
-      (*cells_ptr)->speeds[0][ii + jj*params->nx] = w0;
+      child_cells->speeds[0][ii + jj*child_params.pitch] = w0;
       /* axis directions */
-      (*cells_ptr)->speeds[1][ii + jj*params->nx] = w1;
-      (*cells_ptr)->speeds[2][ii + jj*params->nx] = w1;
-      (*cells_ptr)->speeds[3][ii + jj*params->nx] = w1;
-      (*cells_ptr)->speeds[4][ii + jj*params->nx] = w1;
+      child_cells->speeds[1][ii + jj*child_params.pitch] = w1;
+      child_cells->speeds[2][ii + jj*child_params.pitch] = w1;
+      child_cells->speeds[3][ii + jj*child_params.pitch] = w1;
+      child_cells->speeds[4][ii + jj*child_params.pitch] = w1;
       /* diagonals */
-      (*cells_ptr)->speeds[5][ii + jj*params->nx] = w2;
-      (*cells_ptr)->speeds[6][ii + jj*params->nx] = w2;
-      (*cells_ptr)->speeds[7][ii + jj*params->nx] = w2;
-      (*cells_ptr)->speeds[8][ii + jj*params->nx] = w2;
-    }
-  }
-
-  /* first set all cells in obstacle array to zero */
-  for (int jj = 0; jj < params->ny; jj++)
-  {
-    for (int ii = 0; ii < params->nx; ii++)
-    {
-      (*obstacles_ptr)[ii + jj*params->nx] = 0;
+      child_cells->speeds[5][ii + jj*child_params.pitch] = w2;
+      child_cells->speeds[6][ii + jj*child_params.pitch] = w2;
+      child_cells->speeds[7][ii + jj*child_params.pitch] = w2;
+      child_cells->speeds[8][ii + jj*child_params.pitch] = w2;
+      /* obstacles are read below, halos are filled by exchange_obstacles() */
+      child_obstacles[ii + jj*child_params.pitch] = 0;
     }
   }
 
@@ -1530,57 +4675,33 @@ int initialise(const char* paramfile, const char* obstaclefile,
     die(message, __LINE__, __FILE__);
   }
 
-  /* read-in the blocked cells list */
+  /* read-in the blocked cells list, keeping the ones in the owned block */
   while ((retval = fscanf(fp, "%d %d %d\n", &xx, &yy, &blocked)) != EOF)
   {
     /* some checks */
     if (retval != 3) die("expected 3 values per line in obstacle file", __LINE__, __FILE__);
 
-    if (xx < 0 || xx > params->nx - 1) die("obstacle x-coord out of range", __LINE__, __FILE__);
+    if (xx < 0 || xx > params.nx - 1) die("obstacle x-coord out of range", __LINE__, __FILE__);
 
-    if (yy < 0 || yy > params->ny - 1) die("obstacle y-coord out of range", __LINE__, __FILE__);
+    if (yy < 0 || yy > params.ny - 1) die("obstacle y-coord out of range", __LINE__, __FILE__);
 
     if (blocked != 1) die("obstacle blocked value should be 1", __LINE__, __FILE__);
 
+    int col = xx - decomp->start_col;
+    int row = yy - decomp->start_row;
+    if (col < 0 || col >= decomp->ncols || row < 0 || row >= decomp->nrows) continue;
+
     /* assign to array */
-    (*obstacles_ptr)[xx + yy*params->nx] = blocked;
+    child_obstacles[(col + child_params.halo_cols) + (row + child_params.halo_rows)*child_params.pitch] = blocked;
   }
 
   /* and close the file */
   fclose(fp);
 
-  /*
-  ** allocate space to hold a record of the avarage velocities computed
-  ** at each timestep
-  */
-  *av_vels_ptr = (float*)malloc(sizeof(float) * params->maxIters);
-
-  return EXIT_SUCCESS;
-}
-
-int finalise(const t_param* params, t_speed_arrays** cells_ptr, t_speed_arrays** tmp_cells_ptr,
-             int** obstacles_ptr, float** av_vels_ptr)
-{
-  /*
-  ** free up allocated memory
-  */
-  free_t_speed_arrays(*cells_ptr);
-  *cells_ptr = NULL;
-
-  free_t_speed_arrays(*tmp_cells_ptr);
-  *tmp_cells_ptr = NULL;
-
-  free(*obstacles_ptr);
-  *obstacles_ptr = NULL;
-
-  free(*av_vels_ptr);
-  *av_vels_ptr = NULL;
-
   return EXIT_SUCCESS;
 }
 
-
-float calc_reynolds(const t_param params, t_speed_arrays* cells, int* obstacles)
+float calc_reynolds(const t_param params, t_speed_arrays* cells, unsigned char* obstacles)
 {
   const float viscosity = 1.f / 6.f * (2.f / params.omega - 1.f);
   float value = 0;
@@ -1600,7 +4721,7 @@ float total_density(const t_param params, t_speed_arrays* cells)
     {
       for (int kk = 0; kk < NSPEEDS; kk++)
       {
-        total += cells->speeds[kk][ii + jj*params.nx];
+        total += cells->speeds[kk][ii + jj*params.pitch];
       }
     }
   }
@@ -1608,9 +4729,63 @@ float total_density(const t_param params, t_speed_arrays* cells)
   return total;
 }
 
-int write_values(const t_param params, t_speed_arrays* cells, int* obstacles, float* av_vels)
+/*
+** Write the final state and the average velocities, collective over all
+** processes. Only the master has the average velocities.
+*/
+int write_values(const t_decomp* decomp, const t_param params, const t_param child_params,
+                 t_speed_arrays* child_cells, unsigned char* child_obstacles, float* av_vels)
 {
   FILE* fp;                     /* file pointer */
+  int rank;
+
+  if (MPIIO_OUTPUT)
+  {
+    write_state_mpiio(decomp, params, child_params, child_cells, child_obstacles);
+  }
+  else
+  {
+    write_state_gathered(decomp, params, child_params, child_cells, child_obstacles);
+  }
+
+  MPI_Comm_rank(decomp->comm, &rank);
+  if (rank != 0) return EXIT_SUCCESS;
+
+  if (MPIIO_OUTPUT && BINARY_OUTPUT)
+  {
+    fp = fopen(AVVELSBINFILE, "wb");
+
+    if (fp == NULL)
+    {
+      die("could not open file output file", __LINE__, __FILE__);
+    }
+
+    fwrite(av_vels, sizeof(float), params.maxIters, fp);
+    fclose(fp);
+
+    return EXIT_SUCCESS;
+  }
+
+  fp = fopen(AVVELSFILE, "w");
+
+  if (fp == NULL)
+  {
+    die("could not open file output file", __LINE__, __FILE__);
+  }
+
+  for (int ii = 0; ii < params.maxIters; ii++)
+  {
+    fprintf(fp, "%d:\t%.12E\n", ii, av_vels[ii]);
+  }
+
+  fclose(fp);
+
+  return EXIT_SUCCESS;
+}
+
+/* u_x, u_y, u and pressure of the cell at index, in that order */
+void cell_state(const t_param params, t_speed_arrays* cells, unsigned char* obstacles, int index, float* state)
+{
   const float c_sq = 1.f / 3.f; /* sq. of speed of sound */
   float local_density;         /* per grid cell sum of densities */
   float pressure;              /* fluid pressure in grid cell */
@@ -1618,77 +4793,275 @@ int write_values(const t_param params, t_speed_arrays* cells, int* obstacles, fl
   float u_y;                   /* y-component of velocity in grid cell */
   float u;                     /* norm--root of summed squares--of u_x and u_y */
 
-  fp = fopen(FINALSTATEFILE, "w");
+  /* an occupied cell */
+  if (obstacles[index])
+  {
+    u_x = u_y = u = 0.f;
+    pressure = params.density * c_sq;
+  }
+  /* no obstacle */
+  else
+  {
+    local_density = 0.f;
+
+    for (int kk = 0; kk < NSPEEDS; kk++)
+    {
+      local_density += cells->speeds[kk][index];
+    }
+
+    /* compute x velocity component */
+    u_x = (cells->speeds[1][index]
+           + cells->speeds[5][index]
+           + cells->speeds[8][index]
+           - (cells->speeds[3][index]
+              + cells->speeds[6][index]
+              + cells->speeds[7][index]))
+          / local_density;
+    /* compute y velocity component */
+    u_y = (cells->speeds[2][index]
+           + cells->speeds[5][index]
+           + cells->speeds[6][index]
+           - (cells->speeds[4][index]
+              + cells->speeds[7][index]
+              + cells->speeds[8][index]))
+          / local_density;
+    /* compute norm of velocity */
+    u = sqrtf((u_x * u_x) + (u_y * u_y));
+    /* compute pressure */
+    pressure = local_density * c_sq;
+  }
 
-  if (fp == NULL)
+  state[0] = u_x;
+  state[1] = u_y;
+  state[2] = u;
+  state[3] = pressure;
+}
+
+/*
+** Write final_state.dat from the master. It gathers the grid in bands of
+** about one block of cells and writes each band before gathering the next,
+** so it never holds the whole grid.
+*/
+void write_state_gathered(const t_decomp* decomp, const t_param params, const t_param child_params,
+                          t_speed_arrays* child_cells, unsigned char* child_obstacles)
+{
+  int rank, size;
+  FILE* fp = NULL;              /* file pointer */
+  float state[4];               /* u_x, u_y, u and pressure */
+
+  MPI_Comm_rank(decomp->comm, &rank);
+  MPI_Comm_size(decomp->comm, &size);
+
+  int band_rows = (params.ny + size - 1) / size;
+  t_param band_params = params;
+  band_params.ny = band_rows;
+  t_speed_arrays* cells = NULL;   /* the band of rows being written */
+  unsigned char* obstacles = NULL;
+
+  if (rank == 0)
   {
-    die("could not open file output file", __LINE__, __FILE__);
+    fp = fopen(FINALSTATEFILE, "w");
+
+    if (fp == NULL)
+    {
+      die("could not open file output file", __LINE__, __FILE__);
+    }
+
+    cells = create_t_speed_arrays(band_params);
+    obstacles = (unsigned char*) malloc(params.pitch * band_rows * sizeof(unsigned char));
   }
 
-  for (int jj = 0; jj < params.ny; jj++)
+  for (int band_start = 0; band_start < params.ny; band_start += band_params.ny)
   {
-    for (int ii = 0; ii < params.nx; ii++)
+    /* a band never crosses into the next row of processes */
+    int process_row = 0;
+    while (decomp->row_splits[process_row + 1] <= band_start) ++process_row;
+    band_params.ny = min(band_rows, decomp->row_splits[process_row + 1] - band_start);
+
+    gather_rows(decomp, params, child_params, child_cells, child_obstacles, band_start, band_params.ny,
+                cells, obstacles);
+    if (rank != 0) continue;
+
+    for (int jj = 0; jj < band_params.ny; jj++)
     {
-      /* an occupied cell */
-      if (obstacles[ii + jj*params.nx])
+      for (int ii = 0; ii < params.nx; ii++)
       {
-        u_x = u_y = u = 0.f;
-        pressure = params.density * c_sq;
+        cell_state(params, cells, obstacles, ii + jj*params.pitch, state);
+
+        /* write to file */
+        fprintf(fp, "%d %d %.12E %.12E %.12E %.12E %d\n", ii, band_start + jj,
+                state[0], state[1], state[2], state[3], obstacles[ii + jj*params.pitch]);
       }
-      /* no obstacle */
-      else
+    }
+  }
+
+  if (rank != 0) return;
+
+  fclose(fp);
+  free_t_speed_arrays(cells);
+  free(obstacles);
+}
+
+/*
+** Write final_state with MPI-IO, every process its own block. All records
+** have the same length, so cell (ii, jj) is record ii + jj*nx and the block
+** is a subarray of the file. In text mode the columns are padded to a fixed
+** width, in binary mode a record is u_x, u_y, u, pressure as floats followed
+** by the obstacle flag as an int. The block is formatted and written in bands
+** of rows of about band_cells cells, so the buffer and every count stay small.
+*/
+void write_state_mpiio(const t_decomp* decomp, const t_param params, const t_param child_params,
+                       t_speed_arrays* child_cells, unsigned char* child_obstacles)
+{
+  const int value_width = 19;   /* "-1.234567890123E-05" */
+  const int band_cells = 1 << 18;  /* cells formatted per collective write */
+  char   line[1024];            /* one formatted record */
+  float  state[4];              /* u_x, u_y, u and pressure */
+  MPI_File fh;
+  MPI_Datatype record, block;
+
+  //digits of the widest col and row index
+  int x_width = 1, y_width = 1;
+  for (int n = params.nx - 1; n >= 10; n /= 10) ++x_width;
+  for (int n = params.ny - 1; n >= 10; n /= 10) ++y_width;
+  int record_len = BINARY_OUTPUT ? (int) (4*sizeof(float) + sizeof(int))
+                                 : x_width + 1 + y_width + 1 + 4*(value_width + 1) + 1 + 1;
+
+  int band_rows = max(1, band_cells / decomp->ncols);
+  char* buffer = (char*) malloc((size_t) band_rows * decomp->ncols * record_len);
+  if (buffer == NULL) die("cannot allocate memory for the output buffer", __LINE__, __FILE__);
+
+  //counts and offsets in records, not bytes
+  int sizes[2]    = {params.ny, params.nx};
+  int subsizes[2] = {decomp->nrows, decomp->ncols};
+  int starts[2]   = {decomp->start_row, decomp->start_col};
+  MPI_Type_contiguous(record_len, MPI_CHAR, &record);
+  MPI_Type_commit(&record);
+  MPI_Type_create_subarray(2, sizes, subsizes, starts, MPI_ORDER_C, record, &block);
+  MPI_Type_commit(&block);
+
+  if (MPI_File_open(decomp->comm, BINARY_OUTPUT ? FINALSTATEBINFILE : FINALSTATEFILE,
+                    MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &fh) != MPI_SUCCESS)
+  {
+    die("could not open file output file", __LINE__, __FILE__);
+  }
+  /* drop whatever a previous, larger run left behind */
+  MPI_File_set_size(fh, (MPI_Offset) params.nx * params.ny * record_len);
+  MPI_File_set_view(fh, 0, record, block, "native", MPI_INFO_NULL);
+
+  //the writes are collective, so processes with fewer bands write empty ones
+  int bands = (decomp->nrows + band_rows - 1) / band_rows;
+  int max_bands;
+  MPI_Allreduce(&bands, &max_bands, 1, MPI_INT, MPI_MAX, decomp->comm);
+
+  for (int band = 0; band < max_bands; ++band)
+  {
+    int band_start = min(band * band_rows, decomp->nrows);
+    int band_end = min(band_start + band_rows, decomp->nrows);
+
+    for (int row = band_start; row < band_end; ++row)
+    {
+      for (int col = 0; col < decomp->ncols; ++col)
       {
-        local_density = 0.f;
+        int index = (col + child_params.halo_cols) + (row + child_params.halo_rows)*child_params.pitch;
+        char* record_pos = &buffer[((size_t) (row - band_start)*decomp->ncols + col) * record_len];
+        cell_state(child_params, child_cells, child_obstacles, index, state);
 
-        for (int kk = 0; kk < NSPEEDS; kk++)
+        if (BINARY_OUTPUT)
         {
-          local_density += cells->speeds[kk][ii + jj*params.nx];
+          memcpy(record_pos, state, 4*sizeof(float));
+          int blocked = child_obstacles[index];
+          memcpy(record_pos + 4*sizeof(float), &blocked, sizeof(int));
+        }
+        else
+        {
+          /* snprintf writes a terminating null, so format into line first */
+          int len = snprintf(line, sizeof(line), "%*d %*d %*.12E %*.12E %*.12E %*.12E %d\n",
+                             x_width, decomp->start_col + col, y_width, decomp->start_row + row,
+                             value_width, state[0], value_width, state[1],
+                             value_width, state[2], value_width, state[3], child_obstacles[index]);
+          if (len != record_len) die("final_state record is not fixed width", __LINE__, __FILE__);
+          memcpy(record_pos, line, record_len);
         }
-
-        /* compute x velocity component */
-        u_x = (cells->speeds[1][ii + jj*params.nx]
-               + cells->speeds[5][ii + jj*params.nx]
-               + cells->speeds[8][ii + jj*params.nx]
-               - (cells->speeds[3][ii + jj*params.nx]
-                  + cells->speeds[6][ii + jj*params.nx]
-                  + cells->speeds[7][ii + jj*params.nx]))
-              / local_density;
-        /* compute y velocity component */
-        u_y = (cells->speeds[2][ii + jj*params.nx]
-               + cells->speeds[5][ii + jj*params.nx]
-               + cells->speeds[6][ii + jj*params.nx]
-               - (cells->speeds[4][ii + jj*params.nx]
-                  + cells->speeds[7][ii + jj*params.nx]
-                  + cells->speeds[8][ii + jj*params.nx]))
-              / local_density;
-        /* compute norm of velocity */
-        u = sqrtf((u_x * u_x) + (u_y * u_y));
-        /* compute pressure */
-        pressure = local_density * c_sq;
       }
-
-      /* write to file */
-      fprintf(fp, "%d %d %.12E %.12E %.12E %.12E %d\n", ii, jj, u_x, u_y, u, pressure, obstacles[ii * params.nx + jj]);
     }
-  }
 
-  fclose(fp);
+    MPI_File_write_all(fh, buffer, (band_end - band_start) * decomp->ncols, record, MPI_STATUS_IGNORE);
+  }
+  MPI_File_close(&fh);
 
-  fp = fopen(AVVELSFILE, "w");
+  MPI_Type_free(&block);
+  MPI_Type_free(&record);
+  free(buffer);
+}
 
-  if (fp == NULL)
+/*
+** Compare the output of a 16 bit run with that of an fp32 run of the same
+** problem in ref_dir: the relative error of each av_vels step, and the error
+** of each cell's velocity relative to the largest fp32 velocity. Every step
+** rounds the stored values by up to HALF_ROUNDOFF, and independent roundings
+** grow like the square root of the steps, so more than
+** HALF_ROUNDOFF*sqrt(maxIters) fails. Storing the deviations from rest
+** (HALF_STORAGE 3) rounds what carries the velocity and passes. Plain fp16
+** rounds whole distributions, tens of times larger than the momentum they
+** carry here, so av_vels comes out about 5% off: not usable for this problem.
+*/
+void half_check(const t_param params, const float* av_vels, const char* ref_dir)
+{
+  char   path[512];
+  char   message[1024];  /* message buffer */
+  FILE*  fp;             /* file pointer */
+  FILE*  ref_fp;
+  double vels_error = 0.0;
+  double state_error = 0.0;
+  double max_u = 0.0;
+  float  ref_value, state[4], ref_state[4];
+  int    step, x, y, blocked, ref_x, ref_y, ref_blocked;
+
+  snprintf(path, sizeof(path), "%s/%s", ref_dir, AVVELSFILE);
+  ref_fp = fopen(path, "r");
+  if (ref_fp == NULL)
   {
-    die("could not open file output file", __LINE__, __FILE__);
+    sprintf(message, "could not open reference file: %s", path);
+    die(message, __LINE__, __FILE__);
   }
-
   for (int ii = 0; ii < params.maxIters; ii++)
   {
-    fprintf(fp, "%d:\t%.12E\n", ii, av_vels[ii]);
+    if (fscanf(ref_fp, "%d:\t%E\n", &step, &ref_value) != 2 || step != ii)
+      die("reference av_vels does not match the problem", __LINE__, __FILE__);
+    if (ref_value != 0.f) vels_error = fmax(vels_error, fabs(av_vels[ii] - ref_value) / fabs(ref_value));
   }
+  fclose(ref_fp);
 
+  snprintf(path, sizeof(path), "%s/%s", ref_dir, FINALSTATEFILE);
+  ref_fp = fopen(path, "r");
+  if (ref_fp == NULL)
+  {
+    sprintf(message, "could not open reference file: %s", path);
+    die(message, __LINE__, __FILE__);
+  }
+  fp = fopen(FINALSTATEFILE, "r");
+  if (fp == NULL) die("could not open " FINALSTATEFILE, __LINE__, __FILE__);
+  for (int cell = 0; cell < params.nx * params.ny; cell++)
+  {
+    if (fscanf(fp, "%d %d %E %E %E %E %d\n", &x, &y, &state[0], &state[1], &state[2], &state[3],
+               &blocked) != 7
+        || fscanf(ref_fp, "%d %d %E %E %E %E %d\n", &ref_x, &ref_y, &ref_state[0], &ref_state[1],
+                  &ref_state[2], &ref_state[3], &ref_blocked) != 7
+        || x != ref_x || y != ref_y || blocked != ref_blocked)
+      die("reference final_state does not match the problem", __LINE__, __FILE__);
+    state_error = fmax(state_error, fabs(state[2] - ref_state[2]));
+    max_u = fmax(max_u, fabs(ref_state[2]));
+  }
   fclose(fp);
-
-  return EXIT_SUCCESS;
+  fclose(ref_fp);
+  if (max_u > 0.0) state_error /= max_u;
+
+  double bound = HALF_ROUNDOFF * sqrt((double) params.maxIters);
+  printf("16 bit error against fp32: av_vels %.3e, final_state %.3e, bound %.3e\n",
+         vels_error, state_error, bound);
+  if (vels_error > bound || state_error > bound)
+    die("16 bit run is outside the accepted error bound", __LINE__, __FILE__);
 }
 
 void die(const char* message, const int line, const char* file)
@@ -1701,6 +5074,7 @@ void die(const char* message, const int line, const char* file)
 
 void usage(const char* exe)
 {
-  fprintf(stderr, "Usage: %s <paramfile> <obstaclefile>\n", exe);
+  fprintf(stderr, "Usage: %s <paramfile> <obstaclefile> [--restart] [--row-padding=N] [--halos=sendrecv|fence|pscw]"
+                  " [--obstacle-cost=X|measure] [--half-check=DIR]\n", exe);
   exit(EXIT_FAILURE);
 }